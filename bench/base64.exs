@@ -24,7 +24,7 @@ defmodule Base64 do
       olen++; /* nul termination */
       if (olen < len)
         return "olen < len";
-      out = $alloc(olen);
+      out = $ret_alloc(ret, olen);
 
       end = src + len;
       in = src;
@@ -52,8 +52,7 @@ defmodule Base64 do
 
       *pos = '\0';
 
-      $ret.data = out;
-      $ret.size = pos - out;
+      $ret_shrink(ret, pos - out);
     """
   end
 end
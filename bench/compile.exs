@@ -0,0 +1,43 @@
+defmodule CompileBench do
+  @source """
+  struct point { int64_t x; int64_t y; };
+
+  static int64_t dist(struct point a, struct point b) {
+    int64_t dx = a.x - b.x;
+    int64_t dy = a.y - b.y;
+    return dx * dx + dy * dy;
+  }
+
+  DO_RUN
+    struct point origin = {0, 0};
+    for (int64_t i = 0; i < $a; i++) {
+      struct point p = {i, $a - i};
+      $ret += dist(origin, p);
+    }
+  END_RUN
+  """
+
+  def compile(n) do
+    {:ok, prog} = Niffler.compile("// #{n}\n" <> @source, [a: :int], ret: :int)
+    prog
+  end
+
+  def compile_parallel(count) do
+    1..count
+    |> Task.async_stream(&compile/1, max_concurrency: count, ordered: false)
+    |> Stream.run()
+  end
+end
+
+schedulers = System.schedulers_online()
+{:ok, [_]} = Niffler.run(CompileBench.compile(0), [10])
+
+Benchee.run(
+  %{
+    "compile x1" => fn -> CompileBench.compile(1) end,
+    "compile x#{schedulers} (sequential)" => fn ->
+      Enum.each(1..schedulers, &CompileBench.compile/1)
+    end,
+    "compile x#{schedulers} (parallel)" => fn -> CompileBench.compile_parallel(schedulers) end
+  }
+)
@@ -0,0 +1,35 @@
+defmodule CompileThroughput do
+  # Small formulas like the ones compiled at runtime, each one distinct and
+  # compiled with the cache disabled so that every call runs the compiler.
+  def formula(n) do
+    "$ret = ($a * #{n} + $b) % #{n + 7};"
+  end
+
+  def compile(n) do
+    {:ok, _prog} = Niffler.compile(formula(n), [a: :int, b: :int], [ret: :int], cache: false)
+    :ok
+  end
+
+  def compile_many(count) do
+    Enum.each(1..count, &compile/1)
+  end
+
+  def compile_parallel(count, tasks) do
+    1..tasks
+    |> Task.async_stream(fn _ -> compile_many(count) end, max_concurrency: tasks, ordered: false)
+    |> Stream.run()
+  end
+end
+
+count = 100
+schedulers = System.schedulers_online()
+CompileThroughput.compile_many(count)
+
+Benchee.run(
+  %{
+    "#{count} formulas" => fn -> CompileThroughput.compile_many(count) end,
+    "#{count} formulas x#{schedulers} (parallel)" => fn ->
+      CompileThroughput.compile_parallel(count, schedulers)
+    end
+  }
+)
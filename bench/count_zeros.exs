@@ -15,16 +15,27 @@ defmodule CountZeros do
     "while($str.size--) if (*$str.data++ == 0) $ret++;"
   end
 
+  def count_zeros_budget!(bin) do
+    {:ok, [ret]} = count_zeros_budget(bin)
+    ret
+  end
+
+  defnif :count_zeros_budget, [str: :binary], [ret: :int], loop_budget: true do
+    "while($str.size--) if (*$str.data++ == 0) $ret++;"
+  end
+
 end
 
 bin = :crypto.strong_rand_bytes(64_000)
 
 result = CountZeros.count_zeros_elixir(bin)
 ^result = CountZeros.count_zeros_nif!(bin)
+^result = CountZeros.count_zeros_budget!(bin)
 
 Benchee.run(
   %{
     "count_zeros_elixir" => fn -> CountZeros.count_zeros_elixir(bin) end,
-    "count_zeros_nif" => fn -> CountZeros.count_zeros_nif!(bin) end
+    "count_zeros_nif" => fn -> CountZeros.count_zeros_nif!(bin) end,
+    "count_zeros_loop_budget" => fn -> CountZeros.count_zeros_budget!(bin) end
   }
 )
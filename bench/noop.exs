@@ -18,10 +18,16 @@ end
 0 = Noop.noop_nif!(0)
 {:ok, [0]} = Noop.noop_nif([0])
 
+batch = List.duplicate([0], 1000)
+{:ok, results} = Noop.noop_nif_batch(batch)
+1000 = length(results)
+
 Benchee.run(
   %{
     "noop_nif!" => fn -> Noop.noop_nif!(0) end,
     "noop_nif" => fn -> Noop.noop_nif([0]) end,
-    "noop_elixir" => fn -> Noop.noop_elixir(0) end
+    "noop_elixir" => fn -> Noop.noop_elixir(0) end,
+    "noop_nif_batch (1000 calls)" => fn -> Noop.noop_nif_batch(batch) end,
+    "noop_nif (1000 calls)" => fn -> Enum.each(batch, fn [a] -> Noop.noop_nif(a) end) end
   }
 )
@@ -0,0 +1,42 @@
+defmodule RoundRobin do
+  # Each program gets a few unrolled blocks, so that the code of all programs
+  # together spreads over many pages.
+  def source(n) do
+    body =
+      Enum.map_join(1..16, "\n", fn i -> "$ret = ($ret * #{n + i}) ^ ($a + #{i});" end)
+
+    "// #{n}\n" <> body
+  end
+
+  def compile(count) do
+    programs =
+      for n <- 1..count do
+        {:ok, prog} = Niffler.compile(source(n), [a: :int], [ret: :int], cache: false)
+        prog
+      end
+
+    List.to_tuple(programs)
+  end
+
+  def call_all(programs) do
+    for i <- 0..(tuple_size(programs) - 1) do
+      {:ok, [_]} = Niffler.run(elem(programs, i), [i])
+    end
+
+    :ok
+  end
+end
+
+count = 4096
+Niffler.set_huge_pages(false)
+small_pages = RoundRobin.compile(count)
+Niffler.set_huge_pages(true)
+huge_pages = RoundRobin.compile(count)
+Niffler.set_huge_pages(Application.get_env(:niffler, :huge_pages, false))
+
+Benchee.run(
+  %{
+    "#{count} programs round-robin (4 KB pages)" => fn -> RoundRobin.call_all(small_pages) end,
+    "#{count} programs round-robin (2 MB pages)" => fn -> RoundRobin.call_all(huge_pages) end
+  }
+)
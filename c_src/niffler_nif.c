@@ -1,17 +1,30 @@
 /* Copyright, 2021 Dominic Letz */
 
+#ifdef __linux__
+#define _GNU_SOURCE
+#endif
+
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <stdint.h>
+#include <setjmp.h>
+#include <unistd.h>
+#ifndef _WIN32
+#include <sys/mman.h>
+#endif
 #include "erl_nif.h"
 #include "tinycc/libtcc.h"
 #include "tcclib.h"
 
 static ERL_NIF_TERM error_result(ErlNifEnv *env, const char *error_msg);
 static ERL_NIF_TERM ok_result(ErlNifEnv *env, ERL_NIF_TERM ret);
+static ERL_NIF_TERM compile_result(ErlNifEnv *env, ERL_NIF_TERM program, int compiled);
 static void free_state(ErlNifEnv *env, void *obj);
+static void free_continuation(ErlNifEnv *env, void *obj);
 
 static ErlNifResourceType *PROGRAM_TYPE;
+static ErlNifResourceType *CONTINUATION_TYPE;
 
 typedef struct
 {
@@ -19,20 +32,50 @@ typedef struct
 	unsigned char *data;
 } Binary;
 
+typedef struct
+{
+	uint64_t offset;
+	uint64_t size;
+} Slice;
+
+// Packed numeric array, size is the number of elements
+typedef struct
+{
+	uint64_t size;
+	void *data;
+} Array;
+
+// Segments of an iolist input, size is the number of segments
+typedef struct
+{
+	uint64_t size;
+	Binary *data;
+} IOVec;
+
 typedef struct
 {
 	char name[64];
 	int type;
+	// Index of the referenced input for TYPE_SLICE outputs
+	int source;
+	// Element type of TYPE_ARRAY parameters and if outputs are returned as lists
+	int elem;
+	int as_list;
 } ParamDef;
 
 typedef union
 {
 	Binary binary;
+	Slice slice;
+	Array array;
+	IOVec iovec;
 	int64_t integer64;
 	uint64_t uinteger64;
 	double doubleval;
 } Param;
 
+#define MAX_ARGS 10
+
 typedef struct _Item
 {
 	struct _Item *prev;
@@ -40,26 +83,228 @@ typedef struct _Item
 	char begin;
 } AllocItem;
 
+// Latency buckets with four sub-buckets per power of two, up to 2^40 ns
+#define STATS_BUCKETS 156
+// Default of the run_stats option, every 32nd call is timed
+#define STATS_SAMPLE 32
+#define STATS_SAMPLE_MAX (1 << 20)
+
+// Runtime statistics of one method in one shard. Only the thread owning the
+// shard writes, so the counters are updated without atomic operations. The
+// last shard is shared by threads without one and updated atomically.
+typedef struct
+{
+	uint64_t calls;
+	uint64_t errors;
+	uint64_t bytes_in;
+	uint64_t bytes_out;
+	// Timed calls, every stats_mask + 1th call
+	uint64_t samples;
+	uint64_t total_ns;
+	uint64_t max_ns;
+	uint64_t histogram[STATS_BUCKETS];
+} MethodStats;
+
+// Number of threads with a statistics shard of their own, see load()
+static unsigned stats_shards;
+
+// Bump allocator backing $alloc(), one per thread. Allocations are released
+// all at once by resetting `used` when the call is done. The data starts on
+// an ARENA_ALIGN boundary so every allocation is aligned like malloc().
+#define ARENA_ALIGN 16
+
+typedef struct
+{
+	size_t size;
+	size_t used;
+	size_t high_water;
+	_Alignas(ARENA_ALIGN) char data[];
+} Arena;
+
 typedef struct
 {
 	uint64_t method;
 	AllocItem *head;
+	// Everything above this line is shared with the Env definition
+	// in the Niffler.header() of compiled programs.
+	uint64_t countdown;
+	uint64_t state[4];
+	ErlNifEnv *nif_env;
+	ErlNifTime slice_start;
+	ErlNifTime deadline;
+	int yieldable;
+	int yield_pending;
+	void *continuation;
+	jmp_buf *abort;
+	// Input argument list, used to create sub binaries for slice outputs
+	ERL_NIF_TERM args;
+	// Output binaries allocated with $ret_alloc(), indexed like the outputs
+	Param *output;
+	ErlNifBinary ret[MAX_ARGS];
+	ParamDef *output_defs;
+	// Io vectors of :iovec inputs, indexed like the inputs
+	ErlNifIOVec *iovecs[MAX_ARGS];
+	// Arena used by $alloc(), owned by the env once it has yielded
+	Arena *arena;
+	size_t arena_mark;
+	int arena_owned;
+	// $alloc() only uses malloc(), for envs prepared on another thread
+	int no_arena;
+	// Runtime statistics of the call and the shard they were taken from,
+	// see begin_call() and end_call()
+	MethodStats *stats;
+	unsigned stats_shard;
+	int stats_shared;
+	int stats_timed;
+	ErlNifTime stats_start;
 } Env;
 
-void *niffler_alloc(Env *env, size_t size)
+// Returned by run() when a $yield_point() or $timeslice() asks to reschedule
+#define NIFFLER_YIELD ((const char *)1)
+// Number of $yield_point() calls between two clock reads
+#define YIELD_INTERVAL 1024
+// Length of a normal scheduler timeslice in microseconds
+#define TIMESLICE_USEC 1000
+// Number of loop iterations between two __loop_budget_exhausted() calls
+#define LOOP_BUDGET 4096
+// Number of batch calls between two clock reads
+#define BATCH_INTERVAL 16
+
+// Size of a thread arena, larger $alloc() requests are served by malloc()
+#define ARENA_SIZE (256 * 1024)
+#define ARENA_SPILL (ARENA_SIZE / 4)
+
+// Env of the program currently executing on this thread, only set for
+// programs compiled with a loop budget.
+static __thread Env *current_env;
+static __thread Arena *thread_arena;
+
+// Arena statistics over all threads, updated with atomic builtins
+static size_t arena_high_water;
+static uint64_t arena_spills;
+static uint64_t arena_spill_bytes;
+
+static void init_env(Env *env, uint64_t method, int yieldable)
+{
+	env->method = method;
+	env->head = 0;
+	env->countdown = YIELD_INTERVAL;
+	memset(env->state, 0, sizeof(env->state));
+	env->nif_env = 0;
+	env->slice_start = 0;
+	env->deadline = 0;
+	env->yieldable = yieldable;
+	env->yield_pending = 0;
+	env->continuation = 0;
+	env->abort = 0;
+	env->args = 0;
+	env->output = 0;
+	memset(env->ret, 0, sizeof(env->ret));
+	env->output_defs = 0;
+	memset(env->iovecs, 0, sizeof(env->iovecs));
+	env->arena = 0;
+	env->arena_mark = 0;
+	env->arena_owned = 0;
+	env->no_arena = 0;
+	env->stats = 0;
+	env->stats_shard = 0;
+	env->stats_shared = 0;
+	env->stats_timed = 0;
+	env->stats_start = 0;
+}
+
+static void *spill_alloc(Env *env, size_t size)
 {
 	AllocItem *item = malloc(size + sizeof(AllocItem));
 	if (!item)
 		return 0;
 
-	memset(item, 0, size + sizeof(AllocItem));
+	item->prev = 0;
 	item->next = env->head;
 	env->head = item;
+
+	__atomic_add_fetch(&arena_spills, 1, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&arena_spill_bytes, size, __ATOMIC_RELAXED);
 	return &item->begin;
 }
 
+void *niffler_alloc_uninit(Env *env, size_t size)
+{
+	if (env->no_arena)
+		return spill_alloc(env, size);
+
+	Arena *arena = env->arena;
+	if (!arena)
+	{
+		if (!thread_arena)
+		{
+			thread_arena = malloc(sizeof(Arena) + ARENA_SIZE);
+			if (!thread_arena)
+				return spill_alloc(env, size);
+			thread_arena->size = ARENA_SIZE;
+			thread_arena->used = 0;
+			thread_arena->high_water = 0;
+		}
+		arena = env->arena = thread_arena;
+		env->arena_mark = arena->used;
+	}
+
+	size_t aligned = (size + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1);
+	if (size > ARENA_SPILL || aligned > arena->size - arena->used)
+		return spill_alloc(env, size);
+
+	void *ptr = arena->data + arena->used;
+	arena->used += aligned;
+	if (arena->used > arena->high_water)
+		arena->high_water = arena->used;
+	return ptr;
+}
+
+void *niffler_alloc(Env *env, size_t size)
+{
+	void *ptr = niffler_alloc_uninit(env, size);
+	if (ptr)
+		memset(ptr, 0, size);
+	return ptr;
+}
+
+static void free_arena(Env *env)
+{
+	Arena *arena = env->arena;
+	if (!arena)
+		return;
+
+	size_t high_water = __atomic_load_n(&arena_high_water, __ATOMIC_RELAXED);
+	while (arena->high_water > high_water &&
+		   !__atomic_compare_exchange_n(&arena_high_water, &high_water, arena->high_water, 1,
+										__ATOMIC_RELAXED, __ATOMIC_RELAXED))
+		;
+
+	if (env->arena_owned)
+		free(arena);
+	else
+		arena->used = env->arena_mark;
+
+	env->arena = 0;
+	env->arena_owned = 0;
+}
+
+// A yielding call keeps its $alloc() memory until it is resumed, possibly
+// on another thread. So it takes the thread arena along and the thread
+// starts with a fresh one.
+static void detach_arena(Env *env)
+{
+	if (env->arena && !env->arena_owned && env->arena == thread_arena)
+	{
+		thread_arena = 0;
+		env->arena_owned = 1;
+	}
+}
+
 void free_env(Env *env)
 {
+	free_arena(env);
+
 	while (env->head)
 	{
 		AllocItem *head = env->head;
@@ -69,6 +314,16 @@ void free_env(Env *env)
 			free(head);
 		}
 	}
+
+	for (int i = 0; i < MAX_ARGS; i++)
+	{
+		if (env->ret[i].data)
+			enif_release_binary(&env->ret[i]);
+		if (env->iovecs[i])
+			enif_free_iovec(env->iovecs[i]);
+	}
+	memset(env->ret, 0, sizeof(env->ret));
+	memset(env->iovecs, 0, sizeof(env->iovecs));
 }
 
 #define TYPE_INT64 1
@@ -76,8 +331,180 @@ void free_env(Env *env)
 // #define TYPE_STRING 4
 #define TYPE_BINARY 5
 #define TYPE_DOUBLE 6
+#define TYPE_SLICE 7
+#define TYPE_ARRAY 8
+#define TYPE_IOVEC 9
 
-#define MAX_ARGS 10
+// Longest list of binaries accepted by enif_inspect_iovec() before
+// falling back to flattening the iolist
+#define IOVEC_MAX_SEGMENTS 65536
+
+#define ELEM_INT64 1
+#define ELEM_INT32 2
+#define ELEM_UINT8 3
+#define ELEM_FLOAT32 4
+#define ELEM_DOUBLE 5
+
+static size_t elem_size(int elem)
+{
+	switch (elem)
+	{
+	case ELEM_INT64:
+		return sizeof(int64_t);
+	case ELEM_INT32:
+		return sizeof(int32_t);
+	case ELEM_UINT8:
+		return sizeof(uint8_t);
+	case ELEM_FLOAT32:
+		return sizeof(float);
+	case ELEM_DOUBLE:
+		return sizeof(double);
+	default:
+		return 1;
+	}
+}
+
+// Returns the $ret_alloc() binary of an output and the size of its elements,
+// which is 1 for binaries
+static ErlNifBinary *ret_binary(Env *env, Binary *slot, size_t *unit)
+{
+	if (!env->output)
+		return 0;
+
+	long index = (Param *)slot - env->output;
+	if (index < 0 || index >= MAX_ARGS)
+		return 0;
+
+	*unit = 1;
+	if (env->output_defs && env->output_defs[index].type == TYPE_ARRAY)
+		*unit = elem_size(env->output_defs[index].elem);
+	return &env->ret[index];
+}
+
+void *niffler_ret_alloc(Env *env, Binary *slot, size_t size)
+{
+	size_t unit;
+	ErlNifBinary *bin = ret_binary(env, slot, &unit);
+	if (!bin)
+		return 0;
+
+	if (bin->data)
+		enif_release_binary(bin);
+
+	if (!enif_alloc_binary(size * unit, bin))
+	{
+		memset(bin, 0, sizeof(*bin));
+		return 0;
+	}
+
+	slot->data = bin->data;
+	slot->size = size;
+	return bin->data;
+}
+
+void *niffler_ret_realloc(Env *env, Binary *slot, size_t size)
+{
+	size_t unit;
+	ErlNifBinary *bin = ret_binary(env, slot, &unit);
+	if (!bin)
+		return 0;
+
+	if (!bin->data)
+		return niffler_ret_alloc(env, slot, size);
+
+	if (!enif_realloc_binary(bin, size * unit))
+		return 0;
+
+	slot->data = bin->data;
+	slot->size = size;
+	return bin->data;
+}
+
+int niffler_ret_shrink(Env *env, Binary *slot, size_t size)
+{
+	size_t unit;
+	ErlNifBinary *bin = ret_binary(env, slot, &unit);
+	if (!bin || !bin->data || size * unit > bin->size)
+		return 0;
+
+	slot->size = size;
+	return 1;
+}
+
+int niffler_timeslice(Env *env, int percent)
+{
+	if (!env->yieldable)
+		return 0;
+
+	if (percent < 1)
+		percent = 1;
+	else if (percent > 100)
+		percent = 100;
+
+	return enif_consume_timeslice(env->nif_env, percent);
+}
+
+int niffler_yield_point(Env *env)
+{
+	env->countdown = YIELD_INTERVAL;
+	if (!env->yieldable)
+		return 0;
+
+	if (env->yield_pending)
+	{
+		env->yield_pending = 0;
+		return 1;
+	}
+
+	ErlNifTime now = enif_monotonic_time(ERL_NIF_USEC);
+	if (!env->slice_start)
+	{
+		env->slice_start = now;
+		return 0;
+	}
+
+	int percent = (int)((now - env->slice_start) * 100 / TIMESLICE_USEC);
+	if (percent < 1)
+		return 0;
+
+	env->slice_start = now;
+	return niffler_timeslice(env, percent);
+}
+
+// Called by the code that tcc inserts at loop heads (-floop-budget)
+static int niffler_loop_budget_exhausted(void)
+{
+	Env *env = current_env;
+	if (!env)
+		return LOOP_BUDGET;
+
+	ErlNifTime now = enif_monotonic_time(ERL_NIF_USEC);
+	if (env->deadline && now > env->deadline)
+		longjmp(*env->abort, 1);
+
+	if (!env->yieldable)
+		return LOOP_BUDGET;
+
+	if (!env->slice_start)
+	{
+		env->slice_start = now;
+		return LOOP_BUDGET;
+	}
+
+	int percent = (int)((now - env->slice_start) * 100 / TIMESLICE_USEC);
+	if (percent < 1)
+		return LOOP_BUDGET;
+
+	// Loops can't be resumed at arbitrary points, so the yield is
+	// deferred to the next explicit $yield_point() of the fragment.
+	env->slice_start = now;
+	if (niffler_timeslice(env, percent))
+	{
+		env->yield_pending = 1;
+		env->countdown = 1;
+	}
+	return LOOP_BUDGET;
+}
 
 static int
 atom_to_type(char *atom)
@@ -93,6 +520,24 @@ atom_to_type(char *atom)
 		return TYPE_BINARY;
 	if (strcmp(atom, "double") == 0)
 		return TYPE_DOUBLE;
+	if (strcmp(atom, "iovec") == 0)
+		return TYPE_IOVEC;
+	return -1;
+}
+
+static int
+atom_to_elem(char *atom)
+{
+	if (strcmp(atom, "int64") == 0)
+		return ELEM_INT64;
+	if (strcmp(atom, "int32") == 0)
+		return ELEM_INT32;
+	if (strcmp(atom, "uint8") == 0)
+		return ELEM_UINT8;
+	if (strcmp(atom, "float32") == 0)
+		return ELEM_FLOAT32;
+	if (strcmp(atom, "double") == 0)
+		return ELEM_DOUBLE;
 	return -1;
 }
 
@@ -100,6 +545,8 @@ typedef struct
 {
 	int size;
 	ParamDef *params;
+	// Bit mask of the parameters that pass memory, counted by params_bytes()
+	unsigned sized;
 } Params;
 
 typedef struct
@@ -107,6 +554,9 @@ typedef struct
 	TCCState *state;
 	Params inputs;
 	Params outputs;
+	int dirty;
+	int async;
+	const char *(*runop)(Env *, Param *, Param *);
 } Method;
 
 static void free_methods(Method *methods, unsigned size)
@@ -122,14 +572,184 @@ static void free_methods(Method *methods, unsigned size)
 	}
 }
 
+// Time spent in the phases of a compile in nanoseconds, and the size of the result
+typedef struct
+{
+	ErlNifTime compile;
+	ErlNifTime link;
+	ErlNifTime relocate;
+	ErlNifTime total;
+	TCCStats counts;
+	size_t code_bytes;
+	size_t pages;
+} CompileStats;
+
 typedef struct
 {
 	TCCState *state;
-	const char *(*runop)(Env *, Param *, Param *);
 	Method *methods;
 	unsigned method_count;
+	int loop_budget;
+	uint64_t timeout;
+	int cache;
+	// Memory the program was relocated into, see code_alloc()
+	char *code;
+	size_t code_size;
+	unsigned long code_diff;
+	int code_class;
+	// Memory held by the compiler state before compact()
+	size_t state_size;
+	CompileStats stats;
+	// stats_shards + 1 arrays of per method statistics, allocated by the first
+	// call of a thread. Null without the run_stats option.
+	MethodStats **run_stats;
+	unsigned stats_shards;
+	uint64_t stats_sample;
+	uint64_t stats_mask;
 } Program;
 
+typedef struct
+{
+	Env env;
+	Param input[MAX_ARGS];
+	Param output[MAX_ARGS];
+} Continuation;
+
+typedef struct _Job
+{
+	struct _Job *next;
+	Program *program;
+	uint64_t method_index;
+	// Process independent env holding the inputs, the reference and later the result
+	ErlNifEnv *msg_env;
+	ERL_NIF_TERM args;
+	ERL_NIF_TERM ref;
+	ErlNifPid pid;
+	Env env;
+	Param input[MAX_ARGS];
+} Job;
+
+// Worker threads executing methods compiled with `mode: :async`, they are
+// started on the first async call.
+typedef struct
+{
+	ErlNifMutex *lock;
+	ErlNifCond *cond;
+	ErlNifTid *threads;
+	int thread_count;
+	int stopping;
+	Job *head;
+	Job *tail;
+} Pool;
+
+static Pool pool;
+
+// Stack size of the pool threads in kilowords
+#define POOL_STACK_SIZE 1024
+
+// Compiled programs are shared between all callers compiling the same source
+// with the same parameters and options. Each entry holds a reference on its
+// program, the least recently used entry is dropped when the cache is full.
+#define CACHE_BUCKETS 1024
+#define CACHE_MAX_ENTRIES 512
+
+// Programs compiled with the `object_file` option are stored as relocatable
+// objects, later compiles of the same program only load and relocate them.
+// Objects passed with the `object` option are loaded from the given binary.
+#define OBJECT_PATH_MAX 1024
+#define OBJECT_MAGIC "NIFFLER1"
+#define OBJECT_TRAILER 16
+
+typedef struct _CacheEntry
+{
+	struct _CacheEntry *next;
+	struct _CacheEntry *lru_prev;
+	struct _CacheEntry *lru_next;
+	ErlNifUInt64 hash;
+	// Process independent env holding a copy of the {source, params, options} key
+	ErlNifEnv *key_env;
+	ERL_NIF_TERM key;
+	Program *program;
+} CacheEntry;
+
+typedef struct
+{
+	ErlNifMutex *lock;
+	CacheEntry *buckets[CACHE_BUCKETS];
+	// Most recently used entry first
+	CacheEntry *lru_head;
+	CacheEntry *lru_tail;
+	unsigned size;
+	uint64_t hits;
+	uint64_t misses;
+	uint64_t evictions;
+} Cache;
+
+static Cache cache;
+
+// Programs are relocated into a shared code heap instead of pages of their own.
+// The heap is made of chunks that are mapped twice, once writable and once
+// executable, so no page is ever writable and executable at the same time.
+// Blocks are handed out in power of two size classes from 256 bytes to 64 KB,
+// larger programs get a mapping of their own. With `huge_pages` set chunks
+// are backed by 2 MB pages to cut down on iTLB misses.
+#define HEAP_CHUNK_SIZE (4 << 20)
+#define HEAP_HUGE_PAGE_SIZE (2 << 20)
+#define HEAP_MIN_SHIFT 8
+#define HEAP_CLASSES 9
+#define HEAP_LARGE HEAP_CLASSES
+
+typedef struct _HeapChunk
+{
+	struct _HeapChunk *next;
+	char *rw;
+	size_t map_size;
+	unsigned long diff;
+	size_t used;
+} HeapChunk;
+
+typedef struct _HeapBlock
+{
+	struct _HeapBlock *next;
+	unsigned long diff;
+} HeapBlock;
+
+typedef struct
+{
+	ErlNifMutex *lock;
+	HeapChunk *chunks;
+	// Free blocks of each size class, linked through their writable mapping
+	HeapBlock *free[HEAP_CLASSES];
+	uint64_t live;
+	int huge_pages;
+} CodeHeap;
+
+static CodeHeap heap;
+
+// Compiler data kept by a thread between compiles: the contexts released by
+// compact(), one for each loop_budget setting, which are reset instead of
+// deleted so the next compile reuses their memory, and the prelude snapshot
+// and spare allocators of tcc. Scheduler threads outlive the library, so the
+// caches of all threads are listed here and freed by unload().
+typedef struct ThreadCache
+{
+	struct ThreadCache *next;
+	struct ThreadCache **self;
+	TCCState *states[2];
+	TCCThreadData *tcc;
+} ThreadCache;
+
+typedef struct
+{
+	ErlNifMutex *lock;
+	ThreadCache *head;
+} ThreadCaches;
+
+static ThreadCaches thread_caches;
+static __thread ThreadCache *thread_cache;
+
+static void runtime_symbols_init(void);
+
 static int
 load(ErlNifEnv *env, void **priv, ERL_NIF_TERM load_info)
 {
@@ -137,6 +757,32 @@ load(ErlNifEnv *env, void **priv, ERL_NIF_TERM load_info)
 	PROGRAM_TYPE = enif_open_resource_type(env, "Elixir.Niffler", "state", free_state, flags, NULL);
 	if (PROGRAM_TYPE == 0)
 		return -1;
+	CONTINUATION_TYPE = enif_open_resource_type(env, "Elixir.Niffler", "continuation", free_continuation, flags, NULL);
+	if (CONTINUATION_TYPE == 0)
+		return -1;
+	pool.lock = enif_mutex_create("niffler_pool");
+	pool.cond = enif_cond_create("niffler_pool");
+	if (!pool.lock || !pool.cond)
+		return -1;
+	cache.lock = enif_mutex_create("niffler_cache");
+	if (!cache.lock)
+		return -1;
+	heap.lock = enif_mutex_create("niffler_heap");
+	if (!heap.lock)
+		return -1;
+	thread_caches.lock = enif_mutex_create("niffler_thread_caches");
+	if (!thread_caches.lock)
+		return -1;
+
+	// One runtime statistics shard for each scheduler and pool thread, the
+	// number of dirty schedulers is passed as load_info
+	ErlNifSysInfo info;
+	enif_system_info(&info, sizeof(info));
+	int dirty = 0;
+	if (!enif_get_int(env, load_info, &dirty) || dirty < 0)
+		dirty = 0;
+	stats_shards = 2 * (info.scheduler_threads > 0 ? info.scheduler_threads : 1) + dirty;
+	runtime_symbols_init();
 	return 0;
 }
 
@@ -146,14 +792,139 @@ upgrade(ErlNifEnv *env, void **priv, void **old_priv, ERL_NIF_TERM load_info)
 	return 0;
 }
 
+static void free_job(Job *job);
+static void cache_clear(void);
+static void code_heap_clear(void);
+
+// Must run after the pool threads are joined, no thread compiles anymore
+static void thread_caches_clear(void)
+{
+	enif_mutex_lock(thread_caches.lock);
+	while (thread_caches.head)
+	{
+		ThreadCache *tc = thread_caches.head;
+		thread_caches.head = tc->next;
+		for (int i = 0; i < 2; i++)
+			if (tc->states[i])
+				tcc_delete(tc->states[i]);
+		tcc_free_thread_data(tc->tcc);
+		*tc->self = 0;
+		free(tc);
+	}
+	enif_mutex_unlock(thread_caches.lock);
+	enif_mutex_destroy(thread_caches.lock);
+	memset(&thread_caches, 0, sizeof(thread_caches));
+}
+
 static void
 unload(ErlNifEnv *env, void *priv)
 {
-	return;
+	cache_clear();
+	enif_mutex_destroy(cache.lock);
+	cache.lock = 0;
+	code_heap_clear();
+
+	enif_mutex_lock(pool.lock);
+	pool.stopping = 1;
+	enif_cond_broadcast(pool.cond);
+	enif_mutex_unlock(pool.lock);
+
+	for (int i = 0; i < pool.thread_count; i++)
+		enif_thread_join(pool.threads[i], 0);
+	free(pool.threads);
+
+	while (pool.head)
+	{
+		Job *job = pool.head;
+		pool.head = job->next;
+		free_job(job);
+	}
+
+	enif_cond_destroy(pool.cond);
+	enif_mutex_destroy(pool.lock);
+	memset(&pool, 0, sizeof(pool));
+
+	thread_caches_clear();
+}
+
+static int
+scan_array(ErlNifEnv *env, int arity, const ERL_NIF_TERM *array, int output, ParamDef *p, ERL_NIF_TERM *ret)
+{
+	char atom[32];
+	if (arity < 2 || arity > 3 ||
+		!enif_get_atom(env, array[1], atom, sizeof(atom), ERL_NIF_LATIN1) ||
+		(p->elem = atom_to_elem(atom)) < 0)
+	{
+		*ret = error_result(env, "Parameter element {name, {:array, type}} - type is not a known array type");
+		return 0;
+	}
+
+	if (arity == 3)
+	{
+		if (!output || !enif_get_atom(env, array[2], atom, sizeof(atom), ERL_NIF_LATIN1) ||
+			strcmp(atom, "list") != 0)
+		{
+			*ret = error_result(env, "Parameter element {name, {:array, type, :list}} - only outputs can be returned as lists");
+			return 0;
+		}
+		p->as_list = 1;
+	}
+
+	p->type = TYPE_ARRAY;
+	return 1;
+}
+
+static int
+scan_slice(ErlNifEnv *env, int arity, const ERL_NIF_TERM *array, Params *inputs, ParamDef *p, ERL_NIF_TERM *ret)
+{
+	char source[64];
+	if (!inputs || arity != 2 ||
+		!enif_get_atom(env, array[1], source, sizeof(source), ERL_NIF_LATIN1))
+	{
+		*ret = error_result(env, "Parameter element {name, type} - type is not a known type");
+		return 0;
+	}
+
+	for (int i = 0; i < inputs->size; i++)
+	{
+		if (strcmp(inputs->params[i].name, source) == 0 && inputs->params[i].type == TYPE_BINARY)
+		{
+			p->type = TYPE_SLICE;
+			p->source = i;
+			return 1;
+		}
+	}
+
+	*ret = error_result(env, "Parameter element {name, {:slice, input}} - input is not a binary input");
+	return 0;
+}
+
+// Scans the {:array, ...} and {:slice, ...} types, inputs is 0 when scanning inputs
+static int
+scan_tuple_type(ErlNifEnv *env, ERL_NIF_TERM type, Params *inputs, ParamDef *p, ERL_NIF_TERM *ret)
+{
+	int arity = 0;
+	const ERL_NIF_TERM *array = 0;
+	char atom[32];
+	if (!enif_get_tuple(env, type, &arity, &array) || arity < 1 ||
+		!enif_get_atom(env, array[0], atom, sizeof(atom), ERL_NIF_LATIN1))
+	{
+		*ret = error_result(env, "Parameter element {name, type} - type is not a known type");
+		return 0;
+	}
+
+	if (strcmp(atom, "array") == 0)
+		return scan_array(env, arity, array, inputs != 0, p, ret);
+
+	if (strcmp(atom, "slice") == 0)
+		return scan_slice(env, arity, array, inputs, p, ret);
+
+	*ret = error_result(env, "Parameter element {name, type} - type is not a known type");
+	return 0;
 }
 
 static int
-scan_param(ErlNifEnv *env, ERL_NIF_TERM erlp, ParamDef *p, unsigned size, ERL_NIF_TERM *ret)
+scan_param(ErlNifEnv *env, ERL_NIF_TERM erlp, ParamDef *p, unsigned size, Params *inputs, ERL_NIF_TERM *ret)
 {
 	if (!size)
 		return 1;
@@ -198,6 +969,10 @@ scan_param(ErlNifEnv *env, ERL_NIF_TERM erlp, ParamDef *p, unsigned size, ERL_NI
 		p->name[bin.size] = 0;
 	}
 
+	if (enif_is_tuple(env, array[1]))
+		return scan_tuple_type(env, array[1], inputs, p, ret) &&
+			   scan_param(env, tail, p + 1, size - 1, inputs, ret);
+
 	char atom[32];
 	if (!enif_get_atom(env, array[1], atom, sizeof(atom) - 1, ERL_NIF_LATIN1))
 	{
@@ -212,11 +987,17 @@ scan_param(ErlNifEnv *env, ERL_NIF_TERM erlp, ParamDef *p, unsigned size, ERL_NI
 		return 0;
 	}
 
-	return scan_param(env, tail, p + 1, size - 1, ret);
+	if (p->type == TYPE_IOVEC && inputs)
+	{
+		*ret = error_result(env, "Parameter element {name, :iovec} - iovec is only supported for inputs");
+		return 0;
+	}
+
+	return scan_param(env, tail, p + 1, size - 1, inputs, ret);
 }
 
 static Params
-scan_params(ErlNifEnv *env, ERL_NIF_TERM erl_params, ERL_NIF_TERM *ret)
+scan_params(ErlNifEnv *env, ERL_NIF_TERM erl_params, Params *inputs, ERL_NIF_TERM *ret)
 {
 	Params params = {};
 	unsigned size;
@@ -247,227 +1028,2254 @@ scan_params(ErlNifEnv *env, ERL_NIF_TERM erl_params, ERL_NIF_TERM *ret)
 
 	memset(params.params, 0, sizeof(params.params[0]) * params.size);
 
-	if (!scan_param(env, erl_params, params.params, params.size, ret))
+	if (!scan_param(env, erl_params, params.params, params.size, inputs, ret))
 	{
 		free(params.params);
+		params.params = 0;
 		params.size = -1;
 		return params;
 	}
 
+	for (int i = 0; i < params.size; i++)
+	{
+		int type = params.params[i].type;
+		if (type == TYPE_BINARY || type == TYPE_SLICE || type == TYPE_ARRAY || type == TYPE_IOVEC)
+			params.sized |= 1u << i;
+	}
 	return params;
 }
 
-static ERL_NIF_TERM
-compile(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
+static int
+scan_options(ErlNifEnv *env, ERL_NIF_TERM erl_options, Method *method, ERL_NIF_TERM *ret)
 {
-	ErlNifBinary sourcecode;
-	TCCState *state;
-
-	if (!enif_inspect_binary(env, argv[0], &sourcecode))
-		return enif_make_badarg(env);
-
-	unsigned size;
-	ERL_NIF_TERM method_list = argv[1];
-	if (!enif_get_list_length(env, method_list, &size))
-		return error_result(env, "parameter is not a list");
-
-	if (size == 0)
-		return error_result(env, "parameter list is empty");
+	ERL_NIF_TERM head, tail = erl_options;
+	while (enif_get_list_cell(env, tail, &head, &tail))
+	{
+		int arity = 0;
+		const ERL_NIF_TERM *array = 0;
+		char key[32];
+		char value[32];
+		if (!enif_get_tuple(env, head, &arity, &array) || arity != 2 ||
+			!enif_get_atom(env, array[0], key, sizeof(key), ERL_NIF_LATIN1) ||
+			!enif_get_atom(env, array[1], value, sizeof(value), ERL_NIF_LATIN1))
+		{
+			*ret = error_result(env, "Method option is not a {name, atom} tuple");
+			return 0;
+		}
 
-	Method *methods = malloc(sizeof(Method) * size);
+		if (strcmp(key, "dirty") == 0)
+		{
+			if (strcmp(value, "cpu") == 0)
+				method->dirty = ERL_NIF_DIRTY_JOB_CPU_BOUND;
+			else if (strcmp(value, "io") == 0)
+				method->dirty = ERL_NIF_DIRTY_JOB_IO_BOUND;
+			else if (strcmp(value, "false") == 0)
+				method->dirty = 0;
+			else
+			{
+				*ret = error_result(env, "Method option dirty must be :cpu, :io or false");
+				return 0;
+			}
+		}
+		else if (strcmp(key, "mode") == 0)
+		{
+			if (strcmp(value, "async") == 0)
+				method->async = 1;
+			else if (strcmp(value, "sync") == 0)
+				method->async = 0;
+			else
+			{
+				*ret = error_result(env, "Method option mode must be :sync or :async");
+				return 0;
+			}
+		}
+		else
+		{
+			*ret = error_result(env, "Method option is not a known option");
+			return 0;
+		}
+	}
+
+	if (!enif_is_empty_list(env, tail))
+	{
+		*ret = error_result(env, "Method options are not a list");
+		return 0;
+	}
+
+	return 1;
+}
+
+static int
+scan_program_options(ErlNifEnv *env, ERL_NIF_TERM erl_options, Program *program, char *object_file, ErlNifBinary *object, const char **prelude, ERL_NIF_TERM *ret)
+{
+	ERL_NIF_TERM head, tail = erl_options;
+	while (enif_get_list_cell(env, tail, &head, &tail))
+	{
+		int arity = 0;
+		const ERL_NIF_TERM *array = 0;
+		char key[32];
+		if (!enif_get_tuple(env, head, &arity, &array) || arity != 2 ||
+			!enif_get_atom(env, array[0], key, sizeof(key), ERL_NIF_LATIN1))
+		{
+			*ret = error_result(env, "Program option is not a {name, value} tuple");
+			return 0;
+		}
+
+		if (strcmp(key, "loop_budget") == 0)
+		{
+			char value[8];
+			if (!enif_get_atom(env, array[1], value, sizeof(value), ERL_NIF_LATIN1) ||
+				(strcmp(value, "true") != 0 && strcmp(value, "false") != 0))
+			{
+				*ret = error_result(env, "Program option loop_budget must be a boolean");
+				return 0;
+			}
+			program->loop_budget = strcmp(value, "true") == 0;
+		}
+		else if (strcmp(key, "timeout") == 0)
+		{
+			if (!enif_get_uint64(env, array[1], &program->timeout))
+			{
+				*ret = error_result(env, "Program option timeout must be a positive integer");
+				return 0;
+			}
+		}
+		else if (strcmp(key, "cache") == 0)
+		{
+			char value[8];
+			if (!enif_get_atom(env, array[1], value, sizeof(value), ERL_NIF_LATIN1) ||
+				(strcmp(value, "true") != 0 && strcmp(value, "false") != 0))
+			{
+				*ret = error_result(env, "Program option cache must be a boolean");
+				return 0;
+			}
+			program->cache = strcmp(value, "true") == 0;
+		}
+		else if (strcmp(key, "object_file") == 0)
+		{
+			ErlNifBinary path;
+			if (!enif_inspect_binary(env, array[1], &path) || path.size == 0 || path.size >= OBJECT_PATH_MAX)
+			{
+				*ret = error_result(env, "Program option object_file must be a path");
+				return 0;
+			}
+			memcpy(object_file, path.data, path.size);
+			object_file[path.size] = 0;
+		}
+		else if (strcmp(key, "object") == 0)
+		{
+			if (!enif_inspect_binary(env, array[1], object))
+			{
+				*ret = error_result(env, "Program option object must be a binary");
+				return 0;
+			}
+		}
+		else if (strcmp(key, "run_stats") == 0)
+		{
+			char value[8];
+			if (enif_get_atom(env, array[1], value, sizeof(value), ERL_NIF_LATIN1) &&
+				(strcmp(value, "true") == 0 || strcmp(value, "false") == 0))
+				program->stats_sample = strcmp(value, "true") == 0 ? STATS_SAMPLE : 0;
+			else if (!enif_get_uint64(env, array[1], &program->stats_sample) ||
+					 program->stats_sample == 0 || program->stats_sample > STATS_SAMPLE_MAX)
+			{
+				*ret = error_result(env, "Program option run_stats must be a boolean or a positive integer");
+				return 0;
+			}
+		}
+		else if (strcmp(key, "prelude") == 0)
+		{
+			ErlNifBinary text;
+			if (!enif_inspect_binary(env, array[1], &text) || text.size == 0 || text.data[text.size - 1] != 0)
+			{
+				*ret = error_result(env, "Program option prelude must be a null terminated binary");
+				return 0;
+			}
+			*prelude = (const char *)text.data;
+		}
+		else
+		{
+			*ret = error_result(env, "Program option is not a known option");
+			return 0;
+		}
+	}
+
+	if (!enif_is_empty_list(env, tail))
+	{
+		*ret = error_result(env, "Program options are not a list");
+		return 0;
+	}
+
+	// The timeout is checked on loop budget exhaustion
+	if (program->timeout)
+		program->loop_budget = 1;
+
+	return 1;
+}
+
+static void cache_unlink(CacheEntry *entry)
+{
+	CacheEntry **slot = &cache.buckets[entry->hash % CACHE_BUCKETS];
+	while (*slot != entry)
+		slot = &(*slot)->next;
+	*slot = entry->next;
+
+	if (entry->lru_prev)
+		entry->lru_prev->lru_next = entry->lru_next;
+	else
+		cache.lru_head = entry->lru_next;
+	if (entry->lru_next)
+		entry->lru_next->lru_prev = entry->lru_prev;
+	else
+		cache.lru_tail = entry->lru_prev;
+	cache.size--;
+}
+
+static void cache_touch(CacheEntry *entry)
+{
+	if (cache.lru_head == entry)
+		return;
+
+	entry->lru_prev->lru_next = entry->lru_next;
+	if (entry->lru_next)
+		entry->lru_next->lru_prev = entry->lru_prev;
+	else
+		cache.lru_tail = entry->lru_prev;
+
+	entry->lru_prev = 0;
+	entry->lru_next = cache.lru_head;
+	cache.lru_head->lru_prev = entry;
+	cache.lru_head = entry;
+}
+
+static void free_cache_entry(CacheEntry *entry)
+{
+	enif_release_resource(entry->program);
+	enif_free_env(entry->key_env);
+	free(entry);
+}
+
+// Called with cache.lock held
+static CacheEntry *cache_find(ERL_NIF_TERM key, ErlNifUInt64 hash)
+{
+	for (CacheEntry *entry = cache.buckets[hash % CACHE_BUCKETS]; entry; entry = entry->next)
+	{
+		if (entry->hash == hash && enif_compare(entry->key, key) == 0)
+		{
+			cache_touch(entry);
+			return entry;
+		}
+	}
+	return 0;
+}
+
+static int
+cache_lookup(ErlNifEnv *env, ERL_NIF_TERM key, ErlNifUInt64 hash, ERL_NIF_TERM *term)
+{
+	enif_mutex_lock(cache.lock);
+	CacheEntry *entry = cache_find(key, hash);
+	if (entry)
+	{
+		*term = enif_make_resource(env, entry->program);
+		cache.hits++;
+	}
+	else
+	{
+		cache.misses++;
+	}
+	enif_mutex_unlock(cache.lock);
+	return entry != 0;
+}
+
+// Adds the freshly compiled program to the cache. When another caller has
+// been faster compiling the same key, its program is returned instead.
+static ERL_NIF_TERM
+cache_insert(ErlNifEnv *env, ERL_NIF_TERM key, ErlNifUInt64 hash, Program *program, ERL_NIF_TERM term)
+{
+	CacheEntry *entry = malloc(sizeof(CacheEntry));
+	if (!entry)
+		return term;
+	memset(entry, 0, sizeof(CacheEntry));
+	entry->key_env = enif_alloc_env();
+	if (!entry->key_env)
+	{
+		free(entry);
+		return term;
+	}
+	entry->hash = hash;
+	entry->key = enif_make_copy(entry->key_env, key);
+	entry->program = program;
+	enif_keep_resource(program);
+
+	CacheEntry *evicted = 0;
+	enif_mutex_lock(cache.lock);
+	CacheEntry *existing = cache_find(key, hash);
+	if (existing)
+	{
+		term = enif_make_resource(env, existing->program);
+		evicted = entry;
+	}
+	else
+	{
+		CacheEntry **slot = &cache.buckets[hash % CACHE_BUCKETS];
+		entry->next = *slot;
+		*slot = entry;
+		entry->lru_next = cache.lru_head;
+		if (cache.lru_head)
+			cache.lru_head->lru_prev = entry;
+		else
+			cache.lru_tail = entry;
+		cache.lru_head = entry;
+		cache.size++;
+
+		if (cache.size > CACHE_MAX_ENTRIES)
+		{
+			evicted = cache.lru_tail;
+			cache_unlink(evicted);
+			cache.evictions++;
+		}
+	}
+	enif_mutex_unlock(cache.lock);
+
+	// Releasing might destroy the program, so this happens outside of the lock
+	if (evicted)
+		free_cache_entry(evicted);
+	return term;
+}
+
+static void cache_clear(void)
+{
+	enif_mutex_lock(cache.lock);
+	CacheEntry *entry = cache.lru_head;
+	memset(cache.buckets, 0, sizeof(cache.buckets));
+	cache.lru_head = cache.lru_tail = 0;
+	cache.size = 0;
+	enif_mutex_unlock(cache.lock);
+
+	while (entry)
+	{
+		CacheEntry *next = entry->lru_next;
+		free_cache_entry(entry);
+		entry = next;
+	}
+}
+
+#ifndef _WIN32
+// Reserves `size` bytes of address space aligned to `align`
+static char *code_reserve(size_t size, size_t align)
+{
+	char *area = mmap(0, size + align, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (area == MAP_FAILED)
+		return 0;
+
+	char *aligned = (char *)(((uintptr_t)area + align - 1) & ~(uintptr_t)(align - 1));
+	if (aligned > area)
+		munmap(area, aligned - area);
+	if (area + align > aligned)
+		munmap(aligned + size, area + align - aligned);
+	return aligned;
+}
+
+static int code_memfd(int huge)
+{
+#if defined(__linux__) && defined(MFD_CLOEXEC)
+	if (huge)
+#ifdef MFD_HUGETLB
+		return memfd_create("niffler_code", MFD_CLOEXEC | MFD_HUGETLB);
+#else
+		return -1;
+#endif
+	return memfd_create("niffler_code", MFD_CLOEXEC);
+#else
+	if (huge)
+		return -1;
+
+	char path[] = "/tmp/niffler_codeXXXXXX";
+	int fd = mkstemp(path);
+	if (fd >= 0)
+		unlink(path);
+	return fd;
+#endif
+}
+
+static int code_map_file(int fd, char *area, size_t size)
+{
+	return ftruncate(fd, size) == 0 &&
+		   mmap(area, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED, fd, 0) != MAP_FAILED &&
+		   mmap(area + size, size, PROT_READ | PROT_EXEC, MAP_SHARED | MAP_FIXED, fd, 0) != MAP_FAILED;
+}
+
+// Maps `size` bytes twice in a row, writable and then executable. When that is
+// not possible, e.g. without memfd_create() and with a noexec /tmp, a single
+// writable and executable mapping is used instead. With `huge` the double
+// mapping needs reserved huge pages, as transparent huge pages are usually not
+// enabled for shared memory. Otherwise the single mapping is used and advised
+// to use transparent huge pages.
+static char *code_map(size_t size, int huge, size_t *map_size, unsigned long *diff)
+{
+	char *area = code_reserve(size * 2, huge ? HEAP_HUGE_PAGE_SIZE : (size_t)sysconf(_SC_PAGESIZE));
+	if (!area)
+		return 0;
+
+	// Without enough reserved huge pages mapping the file fails
+	int fd = code_memfd(huge);
+	int mapped = fd >= 0 && code_map_file(fd, area, size);
+	if (fd >= 0)
+		close(fd);
+
+	if (mapped)
+	{
+		*map_size = size * 2;
+		*diff = size;
+	}
+	else
+	{
+		munmap(area + size, size);
+		if (mmap(area, size, PROT_READ | PROT_WRITE | PROT_EXEC, MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED, -1, 0) == MAP_FAILED)
+		{
+			munmap(area, size);
+			return 0;
+		}
+		*map_size = size;
+		*diff = 0;
+	}
+
+#ifdef MADV_HUGEPAGE
+	if (huge && !mapped)
+		madvise(area, *map_size, MADV_HUGEPAGE);
+#endif
+	return area;
+}
+
+// Returns the writable address of a block of at least `size` bytes, the code
+// is executed at that address plus `diff`.
+static char *code_alloc(size_t size, int *size_class, size_t *map_size, unsigned long *diff)
+{
+	int c = 0;
+	while (c < HEAP_CLASSES && ((size_t)1 << (HEAP_MIN_SHIFT + c)) < size)
+		c++;
+
+	*size_class = c;
+	if (c == HEAP_LARGE)
+	{
+		size_t page = sysconf(_SC_PAGESIZE);
+		return code_map((size + page - 1) & ~(page - 1), 0, map_size, diff);
+	}
+
+	size_t block_size = (size_t)1 << (HEAP_MIN_SHIFT + c);
+	*map_size = block_size;
+	char *block = 0;
+
+	enif_mutex_lock(heap.lock);
+	if (heap.free[c])
+	{
+		HeapBlock *free_block = heap.free[c];
+		heap.free[c] = free_block->next;
+		*diff = free_block->diff;
+		block = (char *)free_block;
+	}
+	else
+	{
+		HeapChunk *chunk = heap.chunks;
+		if (!chunk || chunk->used + block_size > HEAP_CHUNK_SIZE)
+		{
+			chunk = malloc(sizeof(HeapChunk));
+			if (chunk)
+				chunk->rw = code_map(HEAP_CHUNK_SIZE, heap.huge_pages, &chunk->map_size, &chunk->diff);
+			if (chunk && chunk->rw)
+			{
+				chunk->used = 0;
+				chunk->next = heap.chunks;
+				heap.chunks = chunk;
+			}
+			else
+			{
+				free(chunk);
+				chunk = 0;
+			}
+		}
+		if (chunk)
+		{
+			block = chunk->rw + chunk->used;
+			chunk->used += block_size;
+			*diff = chunk->diff;
+		}
+	}
+	if (block)
+		heap.live++;
+	enif_mutex_unlock(heap.lock);
+	return block;
+}
+
+static void code_free(char *code, int size_class, size_t map_size, unsigned long diff)
+{
+	if (size_class == HEAP_LARGE)
+	{
+		munmap(code, map_size);
+		return;
+	}
+
+	HeapBlock *block = (HeapBlock *)code;
+	enif_mutex_lock(heap.lock);
+	block->next = heap.free[size_class];
+	block->diff = diff;
+	heap.free[size_class] = block;
+	heap.live--;
+	enif_mutex_unlock(heap.lock);
+}
+
+// Chunks are only unmapped when no program is using them anymore
+static void code_heap_clear(void)
+{
+	if (heap.live == 0)
+	{
+		while (heap.chunks)
+		{
+			HeapChunk *chunk = heap.chunks;
+			heap.chunks = chunk->next;
+			munmap(chunk->rw, chunk->map_size);
+			free(chunk);
+		}
+		memset(heap.free, 0, sizeof(heap.free));
+	}
+}
+
+// The first pass links the program: it adds the runtime, resolves symbols and
+// lays out the sections. The second one copies and relocates the code.
+static int relocate(Program *program)
+{
+	ErlNifTime start = enif_monotonic_time(ERL_NIF_NSEC);
+	int size = tcc_relocate_packed(program->state, 0, 0);
+	if (size < 0)
+		return -1;
+
+	ErlNifTime linked = enif_monotonic_time(ERL_NIF_NSEC);
+	program->stats.link = linked - start;
+	program->code = code_alloc(size, &program->code_class, &program->code_size, &program->code_diff);
+	if (!program->code)
+		return -1;
+
+	int ret = tcc_relocate_packed(program->state, program->code, program->code_diff);
+	program->stats.relocate = enif_monotonic_time(ERL_NIF_NSEC) - linked;
+
+	size_t page = sysconf(_SC_PAGESIZE);
+	uintptr_t first = (uintptr_t)program->code / page;
+	uintptr_t last = ((uintptr_t)program->code + (size ? size - 1 : 0)) / page;
+	program->stats.code_bytes = size;
+	program->stats.pages = last - first + 1;
+	return ret;
+}
+#else
+static void code_heap_clear(void) {}
+
+static int relocate(Program *program)
+{
+	ErlNifTime start = enif_monotonic_time(ERL_NIF_NSEC);
+	int ret = tcc_relocate(program->state, TCC_RELOCATE_AUTO);
+	program->stats.link = enif_monotonic_time(ERL_NIF_NSEC) - start;
+	return ret;
+}
+#endif
+
+// Symbols exported to programs, sorted by name on load. Programs resolve their
+// undefined symbols against this table when they are relocated, so adding
+// exports to symbols.def does not make compiles slower.
+typedef struct
+{
+	const char *name;
+	const void *value;
+} RuntimeSymbol;
+
+static RuntimeSymbol runtime_symbols[] = {
+#define X(name) {#name, 0},
+#include "symbols.def"
+#undef X
+	{"__loop_budget_exhausted", 0},
+};
+
+#define RUNTIME_SYMBOL_COUNT (sizeof(runtime_symbols) / sizeof(RuntimeSymbol))
+
+static int runtime_symbol_cmp(const void *a, const void *b)
+{
+	return strcmp(((const RuntimeSymbol *)a)->name, ((const RuntimeSymbol *)b)->name);
+}
+
+static void runtime_symbols_init(void)
+{
+	unsigned i = 0;
+	#define X(name) runtime_symbols[i++] = (RuntimeSymbol){#name, name};
+	#include "symbols.def"
+	#undef X
+	runtime_symbols[i++] = (RuntimeSymbol){"__loop_budget_exhausted", niffler_loop_budget_exhausted};
+	qsort(runtime_symbols, RUNTIME_SYMBOL_COUNT, sizeof(RuntimeSymbol), runtime_symbol_cmp);
+}
+
+static void *runtime_symbol(void *opaque, const char *name)
+{
+	RuntimeSymbol key = {name, 0};
+	RuntimeSymbol *symbol = bsearch(&key, runtime_symbols, RUNTIME_SYMBOL_COUNT, sizeof(RuntimeSymbol), runtime_symbol_cmp);
+	return symbol ? (void *)symbol->value : 0;
+}
+
+static ThreadCache *get_thread_cache(void)
+{
+	ThreadCache *tc = thread_cache;
+	if (tc)
+		return tc;
+	tc = calloc(1, sizeof(ThreadCache));
+	if (!tc)
+		return 0;
+	tc->self = &thread_cache;
+	tc->tcc = tcc_thread_data();
+	enif_mutex_lock(thread_caches.lock);
+	tc->next = thread_caches.head;
+	thread_caches.head = tc;
+	enif_mutex_unlock(thread_caches.lock);
+	thread_cache = tc;
+	return tc;
+}
+
+// The prelude holds the declarations shared by all sources. tcc parses it once
+// per thread and later compiles start from a snapshot of it.
+static TCCState *new_state(int output_type, int loop_budget, const char *prelude)
+{
+	// Registers the thread before tcc keeps anything on it
+	ThreadCache *tc = get_thread_cache();
+	if (!tc)
+		return 0;
+
+	TCCState *state = 0;
+	if (output_type == TCC_OUTPUT_MEMORY)
+	{
+		state = tc->states[loop_budget];
+		tc->states[loop_budget] = 0;
+	}
+	if (state)
+	{
+		tcc_set_prelude(state, prelude);
+		return state;
+	}
+
+	state = tcc_new();
+	if (!state)
+		return 0;
+
+	if (tcc_set_output_type(state, output_type) != 0)
+	{
+		tcc_delete(state);
+		return 0;
+	}
+
+	if (loop_budget)
+		tcc_set_options(state, "-floop-budget");
+	if (prelude)
+		tcc_set_prelude(state, prelude);
+	return state;
+}
+
+static void discard_error(void *opaque, const char *message) {}
+
+// Only the `run_<index>` entry functions are global across units. Targets
+// with a leading underscore, such as macOS, prefix the symbol names.
+static int is_entry(void *ctx, const char *name)
+{
+	if (*name == '_')
+		name++;
+	if (strncmp(name, "run_", 4) != 0 || !name[4])
+		return 0;
+	for (name += 4; *name; name++)
+		if (*name < '0' || *name > '9')
+			return 0;
+	return 1;
+}
+
+// Method entry of units that failed to compile, see compile()
+static const char *compile_failed(Env *env, Param *input, Param *output)
+{
+	return "compilation error";
+}
+
+// Programs are compiled from a single source, or from a list of sources that
+// are compiled as separate translation units. Then each method has its own
+// entry function `run_<index>` instead of the shared `run`, and all other
+// global symbols of a unit are made local to it, so helpers of different
+// units don't collide. Units of methods that already have an entry are
+// skipped. When a unit fails to compile its index is stored in `failed`.
+static int compile_sources(ErlNifEnv *env, TCCState *state, ERL_NIF_TERM code, Method *methods, unsigned *failed)
+{
+	ErlNifBinary source;
+	if (enif_inspect_binary(env, code, &source))
+		return tcc_compile_string(state, (const char *)source.data) == 0;
+
+	ERL_NIF_TERM head, tail = code;
+	for (unsigned i = 0; enif_get_list_cell(env, tail, &head, &tail); i++)
+	{
+		if (methods && methods[i].runop)
+			continue;
+		if (!enif_inspect_binary(env, head, &source) || tcc_compile_string(state, (const char *)source.data) != 0)
+		{
+			*failed = i;
+			return 0;
+		}
+		tcc_localize_symbols(state, 0, is_entry);
+	}
+	return 1;
+}
+
+static uint64_t object_checksum(const unsigned char *data, size_t size)
+{
+	// FNV-1a
+	uint64_t hash = 14695981039346656037ULL;
+	for (size_t i = 0; i < size; i++)
+		hash = (hash ^ data[i]) * 1099511628211ULL;
+	return hash;
+}
+
+static unsigned char *read_file(const char *path, size_t *size)
+{
+	FILE *file = fopen(path, "rb");
+	if (!file)
+		return 0;
+
+	unsigned char *data = 0;
+	long length;
+	if (fseek(file, 0, SEEK_END) == 0 && (length = ftell(file)) > 0 && fseek(file, 0, SEEK_SET) == 0)
+	{
+		data = malloc(length);
+		if (data && fread(data, 1, length, file) != (size_t)length)
+		{
+			free(data);
+			data = 0;
+		}
+		*size = length;
+	}
+	fclose(file);
+	return data;
+}
+
+// Objects end with a trailer of OBJECT_MAGIC and the checksum of everything
+// before it, truncated or otherwise damaged files are never loaded.
+static int object_data_valid(const unsigned char *data, size_t size)
+{
+	uint64_t checksum;
+	if (size <= OBJECT_TRAILER || memcmp(data + size - OBJECT_TRAILER, OBJECT_MAGIC, 8) != 0)
+		return 0;
+
+	memcpy(&checksum, data + size - 8, 8);
+	return checksum == object_checksum(data, size - OBJECT_TRAILER);
+}
+
+static int object_valid(const char *path)
+{
+	size_t size;
+	unsigned char *data = read_file(path, &size);
+	if (!data)
+		return 0;
+
+	int valid = object_data_valid(data, size);
+	free(data);
+	return valid;
+}
+
+// Compiles the source into an object file. The object is written to a temporary
+// file first and then renamed, so other nodes sharing the directory never see
+// partially written objects. Returns -1 on compilation errors and 0 when the
+// object could not be written.
+static int write_object(ErlNifEnv *env, const char *path, ERL_NIF_TERM code, int loop_budget, const char *prelude)
+{
+	static uint64_t counter;
+	TCCState *state = new_state(TCC_OUTPUT_OBJ, loop_budget, prelude);
+	if (!state)
+		return 0;
+
+	// Errors of separate units are reported by the compile in memory, which
+	// leaves out the failing units
+	unsigned failed;
+	if (enif_is_list(env, code))
+		tcc_set_error_func(state, 0, discard_error);
+	if (!compile_sources(env, state, code, 0, &failed))
+	{
+		tcc_delete(state);
+		return -1;
+	}
+
+	char tmp[OBJECT_PATH_MAX + 64];
+	snprintf(tmp, sizeof(tmp), "%s.%d.%llu.tmp", path, (int)getpid(),
+			 (unsigned long long)__atomic_add_fetch(&counter, 1, __ATOMIC_RELAXED));
+	int ok = tcc_output_file(state, tmp) == 0;
+	tcc_delete(state);
+
+	size_t size;
+	unsigned char *data = ok ? read_file(tmp, &size) : 0;
+	ok = 0;
+	if (data)
+	{
+		uint64_t checksum = object_checksum(data, size);
+		FILE *file = fopen(tmp, "ab");
+		if (file)
+		{
+			ok = fwrite(OBJECT_MAGIC, 1, 8, file) == 8 && fwrite(&checksum, 1, 8, file) == 8;
+			ok = fclose(file) == 0 && ok;
+		}
+		free(data);
+	}
+
+	if (!ok || rename(tmp, path) != 0)
+	{
+		remove(tmp);
+		return 0;
+	}
+	return 1;
+}
+
+static TCCState *load_object(const char *path, int loop_budget)
+{
+	if (!object_valid(path))
+		return 0;
+
+	TCCState *state = new_state(TCC_OUTPUT_MEMORY, loop_budget, 0);
+	if (state && tcc_add_file(state, path) != 0)
+	{
+		tcc_delete(state);
+		state = 0;
+	}
+	return state;
+}
+
+// libtcc only loads objects from files, so the binary is written to a new
+// private temporary file that is removed again right after loading it.
+static TCCState *load_object_data(const ErlNifBinary *object, int loop_budget)
+{
+	if (!object_data_valid(object->data, object->size))
+		return 0;
+
+	const char *dir = getenv("TMPDIR");
+	char path[OBJECT_PATH_MAX];
+	if (snprintf(path, sizeof(path), "%s/niffler.XXXXXX", dir && *dir ? dir : "/tmp") >= (int)sizeof(path))
+		return 0;
+
+	int fd = mkstemp(path);
+	if (fd < 0)
+		return 0;
+
+	size_t written = 0;
+	while (written < object->size)
+	{
+		ssize_t n = write(fd, object->data + written, object->size - written);
+		if (n <= 0)
+			break;
+		written += n;
+	}
+
+	TCCState *state = 0;
+	if (close(fd) == 0 && written == object->size)
+	{
+		state = new_state(TCC_OUTPUT_MEMORY, loop_budget, 0);
+		if (state && tcc_add_file(state, path) != 0)
+		{
+			tcc_delete(state);
+			state = 0;
+		}
+	}
+	remove(path);
+	return state;
+}
+
+// Returns a state with the object file at `path` loaded, writing the object
+// first when it does not exist yet. Invalid objects are replaced. Returns 0
+// when the object can't be used, then the source should be compiled in memory.
+static TCCState *object_state(ErlNifEnv *env, const char *path, ERL_NIF_TERM code, int loop_budget, const char *prelude, int *compile_error)
+{
+	TCCState *state = load_object(path, loop_budget);
+	if (state)
+		return state;
+
+	remove(path);
+	int written = write_object(env, path, code, loop_budget, prelude);
+	if (written < 0)
+		*compile_error = 1;
+	if (written <= 0)
+		return 0;
+
+	return load_object(path, loop_budget);
+}
+
+// Once relocated a program only needs its code and the entry points of its
+// methods, the compiler state with its sections, symbols and relocations is
+// released. Without the code heap (Windows) the code lives in the state.
+static void compact(Program *program)
+{
+	program->state_size = tcc_memory_usage(program->state);
+#ifndef _WIN32
+	ThreadCache *tc = get_thread_cache();
+	TCCState **pooled = tc ? &tc->states[program->loop_budget] : 0;
+	if (!pooled || *pooled)
+		tcc_delete(program->state);
+	else
+	{
+		tcc_reset(program->state);
+		*pooled = program->state;
+	}
+	program->state = 0;
+#endif
+}
+
+static size_t program_metadata_size(Program *program)
+{
+	size_t size = sizeof(Program) + sizeof(Method) * program->method_count;
+	for (unsigned i = 0; i < program->method_count; i++)
+		size += sizeof(ParamDef) * (program->methods[i].inputs.size + program->methods[i].outputs.size);
+	if (program->run_stats)
+	{
+		size += sizeof(MethodStats *) * (program->stats_shards + 1);
+		for (unsigned i = 0; i <= program->stats_shards; i++)
+			if (__atomic_load_n(&program->run_stats[i], __ATOMIC_ACQUIRE))
+				size += sizeof(MethodStats) * program->method_count;
+	}
+	return size;
+}
+
+static ERL_NIF_TERM
+compile(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
+{
+	ErlNifTime start = enif_monotonic_time(ERL_NIF_NSEC);
+	TCCState *state;
+	unsigned units = 0;
+	int separate_units = enif_get_list_length(env, argv[0], &units);
+	if (!separate_units && !enif_is_binary(env, argv[0]))
+		return enif_make_badarg(env);
+
+	// Options are scanned first as they decide whether the cache is used
+	Program options;
+	memset(&options, 0, sizeof(Program));
+	options.cache = 1;
+	char object_file[OBJECT_PATH_MAX] = {0};
+	ErlNifBinary object = {0};
+	const char *prelude = 0;
+	ERL_NIF_TERM ret;
+	if (!scan_program_options(env, argv[2], &options, object_file, &object, &prelude, &ret))
+		return ret;
+
+	ERL_NIF_TERM term;
+	ERL_NIF_TERM key = enif_make_tuple3(env, argv[0], argv[1], argv[2]);
+	ErlNifUInt64 hash = enif_hash(ERL_NIF_INTERNAL_HASH, key, 0);
+	if (options.cache && cache_lookup(env, key, hash, &term))
+		return compile_result(env, term, 0);
+
+	unsigned size;
+	ERL_NIF_TERM method_list = argv[1];
+	if (!enif_get_list_length(env, method_list, &size))
+		return error_result(env, "parameter is not a list");
+
+	if (size == 0)
+		return error_result(env, "parameter list is empty");
+
+	if (separate_units && units != size)
+		return error_result(env, "source list does not match the parameter list");
+
+	Method *methods = malloc(sizeof(Method) * size);
 	if (!methods)
 		return error_result(env, "could not allocate method list");
 
-	memset(methods, 0, sizeof(Method) * size);
+	memset(methods, 0, sizeof(Method) * size);
+
+	for (unsigned i = 0; i < size; i++)
+	{
+		ERL_NIF_TERM head;
+		if (!enif_get_list_cell(env, method_list, &head, &method_list)) 
+			return error_result(env, "could get method list element");
+
+		int arity;
+		const ERL_NIF_TERM* tuple;
+		if (!enif_get_tuple(env, head, &arity, &tuple) || arity < 2 || arity > 3)
+			return error_result(env, "method list element is not a 2 or 3-element tuple");
+
+
+		ret = error_result(env, "failed to scan input parameters");
+		methods[i].inputs = scan_params(env, tuple[0], 0, &ret);
+		if (methods[i].inputs.size < 0)
+		{
+			free_methods(methods, size);
+			return ret;
+		}
+		ret = error_result(env, "failed to scan output parameters");
+		methods[i].outputs = scan_params(env, tuple[1], &methods[i].inputs, &ret);
+		if (methods[i].outputs.size < 0)
+		{
+			free_methods(methods, size);
+			return ret;
+		}
+		if (arity == 3 && !scan_options(env, tuple[2], &methods[i], &ret))
+		{
+			free_methods(methods, size);
+			return ret;
+		}
+	}
+
+	// Without a usable object the source is compiled in memory
+	state = 0;
+	ErlNifTime compile_start = enif_monotonic_time(ERL_NIF_NSEC);
+	if (object.size)
+		state = load_object_data(&object, options.loop_budget);
+	else if (*object_file)
+	{
+		int compile_error = 0;
+		state = object_state(env, object_file, argv[0], options.loop_budget, prelude, &compile_error);
+		if (compile_error && !separate_units)
+		{
+			free_methods(methods, size);
+			return error_result(env, "compilation error");
+		}
+	}
+
+	int compiled = state != 0;
+	if (!state)
+		state = new_state(TCC_OUTPUT_MEMORY, options.loop_budget, prelude);
+	if (!state)
+	{
+		free_methods(methods, size);
+		return error_result(env, "could not initiate tcc state");
+	}
+
+	Program *program = enif_alloc_resource(PROGRAM_TYPE, sizeof(Program));
+	program->state = state;
+	program->methods = methods;
+	program->method_count = size;
+	program->loop_budget = options.loop_budget;
+	program->timeout = options.timeout;
+	program->run_stats = 0;
+	program->stats_sample = options.stats_sample;
+	program->stats_mask = 0;
+	// Calls are sampled with a mask, so the interval is rounded up to a power of two
+	while (program->stats_mask + 1 < options.stats_sample)
+		program->stats_mask = (program->stats_mask << 1) | 1;
+	program->cache = options.cache;
+	program->code = 0;
+	program->state_size = 0;
+	memset(&program->stats, 0, sizeof(CompileStats));
+
+	term = enif_make_resource(env, program);
+	enif_release_resource(program);
+
+	program->stats_shards = stats_shards;
+	if (options.stats_sample && !(program->run_stats = calloc(stats_shards + 1, sizeof(MethodStats *))))
+		return error_result(env, "could not allocate run statistics");
+
+	// A unit that fails to compile is left out and its method returns the
+	// error when called. The other units are compiled again in a new state.
+	unsigned failed, failures = 0;
+	while (!compiled && !compile_sources(env, state, argv[0], methods, &failed))
+	{
+		if (!separate_units || ++failures == size)
+			return error_result(env, "compilation error");
+
+		methods[failed].runop = compile_failed;
+		tcc_delete(state);
+		program->state = state = new_state(TCC_OUTPUT_MEMORY, options.loop_budget, prelude);
+		if (!state)
+			return error_result(env, "could not initiate tcc state");
+	}
+	program->stats.compile = enif_monotonic_time(ERL_NIF_NSEC) - compile_start;
+
+#ifdef _WIN32
+	for (unsigned i = 0; i < RUNTIME_SYMBOL_COUNT; i++)
+		tcc_add_symbol(state, runtime_symbols[i].name, runtime_symbols[i].value);
+#else
+	tcc_set_resolve_func(state, 0, runtime_symbol);
+#endif
+
+	tcc_set_options(state, "-nostdlib");
+	if (relocate(program) != 0)
+		return error_result(env, "could not relocate program");
+
+	for (unsigned i = 0; i < size; i++)
+	{
+		if (methods[i].runop)
+			continue;
+
+		char entry[32] = "run";
+		if (separate_units)
+			snprintf(entry, sizeof(entry), "run_%u", i);
+
+		methods[i].runop = tcc_get_symbol(state, entry);
+		if (!methods[i].runop)
+		{
+			char error[64];
+			snprintf(error, sizeof(error), " %s is undefined", entry);
+			return error_result(env, error);
+		}
+	}
+
+	tcc_get_stats(state, &program->stats.counts);
+	compact(program);
+	program->stats.total = enif_monotonic_time(ERL_NIF_NSEC) - start;
+	if (program->cache)
+		term = cache_insert(env, key, hash, program, term);
+
+	return compile_result(env, term, 1);
+}
+
+static void free_state(ErlNifEnv *env, void *obj)
+{
+	Program *program = (Program *)obj;
+	if (program->state)
+		tcc_delete(program->state);
+	free_methods(program->methods, program->method_count);
+	if (program->run_stats)
+	{
+		for (unsigned i = 0; i <= program->stats_shards; i++)
+			free(program->run_stats[i]);
+		free(program->run_stats);
+	}
+#ifndef _WIN32
+	if (program->code)
+		code_free(program->code, program->code_class, program->code_size, program->code_diff);
+#endif
+}
+
+static void free_continuation(ErlNifEnv *env, void *obj)
+{
+	Continuation *cont = (Continuation *)obj;
+	free_env(&cont->env);
+}
+
+static int
+decode_array(ErlNifEnv *env, ParamDef *def, ERL_NIF_TERM term, Array *array, Env *user_env)
+{
+	size_t unit = elem_size(def->elem);
+
+	// Packed binaries are used in place, unless they are not aligned to the
+	// element size, as is possible for sub binaries
+	ErlNifBinary bin;
+	if (enif_inspect_binary(env, term, &bin))
+	{
+		if (bin.size % unit != 0)
+			return 0;
+		array->size = bin.size / unit;
+		array->data = bin.data;
+		if ((uintptr_t)bin.data % unit != 0)
+		{
+			array->data = niffler_alloc_uninit(user_env, bin.size);
+			if (!array->data && bin.size)
+				return 0;
+			memcpy(array->data, bin.data, bin.size);
+		}
+		return 1;
+	}
+
+	unsigned length;
+	if (!enif_get_list_length(env, term, &length))
+		return 0;
+
+	array->size = length;
+	array->data = niffler_alloc_uninit(user_env, length * unit);
+	if (!array->data && length)
+		return 0;
+
+	ERL_NIF_TERM head, tail = term;
+	for (unsigned i = 0; enif_get_list_cell(env, tail, &head, &tail); i++)
+	{
+		ErlNifSInt64 integer;
+		double doubleval;
+		switch (def->elem)
+		{
+		case ELEM_INT64:
+			if (!enif_get_int64(env, head, &integer))
+				return 0;
+			((int64_t *)array->data)[i] = integer;
+			break;
+		case ELEM_INT32:
+			if (!enif_get_int64(env, head, &integer) || integer < INT32_MIN || integer > INT32_MAX)
+				return 0;
+			((int32_t *)array->data)[i] = (int32_t)integer;
+			break;
+		case ELEM_UINT8:
+			if (!enif_get_int64(env, head, &integer) || integer < 0 || integer > UINT8_MAX)
+				return 0;
+			((uint8_t *)array->data)[i] = (uint8_t)integer;
+			break;
+		case ELEM_FLOAT32:
+		case ELEM_DOUBLE:
+			if (!enif_get_double(env, head, &doubleval))
+			{
+				if (!enif_get_int64(env, head, &integer))
+					return 0;
+				doubleval = (double)integer;
+			}
+			if (def->elem == ELEM_FLOAT32)
+				((float *)array->data)[i] = (float)doubleval;
+			else
+				((double *)array->data)[i] = doubleval;
+			break;
+		default:
+			return 0;
+		}
+	}
+
+	return 1;
+}
+
+static int
+encode_array(ErlNifEnv *env, ParamDef *def, Array *array, ErlNifBinary *ret_bin, ERL_NIF_TERM *ret)
+{
+	size_t unit = elem_size(def->elem);
+
+	if (def->as_list)
+	{
+		*ret = enif_make_list(env, 0);
+		for (uint64_t i = array->size; i > 0; i--)
+		{
+			ERL_NIF_TERM cell;
+			switch (def->elem)
+			{
+			case ELEM_INT64:
+				cell = enif_make_int64(env, ((int64_t *)array->data)[i - 1]);
+				break;
+			case ELEM_INT32:
+				cell = enif_make_int64(env, ((int32_t *)array->data)[i - 1]);
+				break;
+			case ELEM_UINT8:
+				cell = enif_make_int64(env, ((uint8_t *)array->data)[i - 1]);
+				break;
+			case ELEM_FLOAT32:
+				cell = enif_make_double(env, ((float *)array->data)[i - 1]);
+				break;
+			default:
+				cell = enif_make_double(env, ((double *)array->data)[i - 1]);
+				break;
+			}
+			*ret = enif_make_list_cell(env, cell, *ret);
+		}
+		return 1;
+	}
+
+	// Arrays from $ret_alloc() are handed over without a copy
+	size_t size = array->size * unit;
+	if (ret_bin->data && ret_bin->data == array->data && size <= ret_bin->size)
+	{
+		if (size < ret_bin->size && !enif_realloc_binary(ret_bin, size))
+			return 0;
+
+		*ret = enif_make_binary(env, ret_bin);
+		memset(ret_bin, 0, sizeof(*ret_bin));
+		return 1;
+	}
+
+	unsigned char *bin = enif_make_new_binary(env, size, ret);
+	if (!bin)
+		return 0;
+
+	if (size)
+		memcpy(bin, array->data, size);
+	return 1;
+}
+
+static int
+decode_iovec(ErlNifEnv *env, ERL_NIF_TERM term, IOVec *iovec, ErlNifIOVec **owned, Env *user_env)
+{
+	ErlNifBinary bin;
+	if (enif_inspect_binary(env, term, &bin))
+	{
+		iovec->data = niffler_alloc_uninit(user_env, sizeof(Binary));
+		if (!iovec->data)
+			return 0;
+		iovec->size = 1;
+		iovec->data[0].size = bin.size;
+		iovec->data[0].data = bin.data;
+		return 1;
+	}
+
+	// Lists of binaries are referenced segment by segment. The io vector is
+	// created without env so it stays valid when the call yields.
+	ERL_NIF_TERM tail;
+	ErlNifIOVec *iov;
+	if (enif_inspect_iovec(0, IOVEC_MAX_SEGMENTS, term, &tail, &iov))
+	{
+		if (enif_is_empty_list(env, tail))
+		{
+			*owned = iov;
+			iovec->size = iov->iovcnt;
+			iovec->data = niffler_alloc_uninit(user_env, sizeof(Binary) * iov->iovcnt);
+			if (!iovec->data && iov->iovcnt)
+				return 0;
+			for (int i = 0; i < iov->iovcnt; i++)
+			{
+				iovec->data[i].size = iov->iov[i].iov_len;
+				iovec->data[i].data = iov->iov[i].iov_base;
+			}
+			return 1;
+		}
+		enif_free_iovec(iov);
+	}
+
+	// Any other iodata, e.g. with nested lists or bytes, is flattened
+	if (!enif_inspect_iolist_as_binary(env, term, &bin))
+		return 0;
+
+	iovec->data = niffler_alloc_uninit(user_env, sizeof(Binary));
+	if (!iovec->data)
+		return 0;
+	iovec->size = 1;
+	iovec->data[0].size = bin.size;
+	iovec->data[0].data = bin.data;
+
+	// The flattened binary only lives until this nif call returns
+	if (user_env->yieldable)
+	{
+		iovec->data[0].data = niffler_alloc_uninit(user_env, bin.size);
+		if (!iovec->data[0].data && bin.size)
+			return 0;
+		memcpy(iovec->data[0].data, bin.data, bin.size);
+	}
+	return 1;
+}
+
+static int
+decode_inputs(ErlNifEnv *env, Method *method, ERL_NIF_TERM args, Param *input, Env *user_env, ERL_NIF_TERM *ret)
+{
+	ERL_NIF_TERM head, tail = args;
+	for (int i = 0; i < method->inputs.size; i++)
+	{
+		if (!enif_get_list_cell(env, tail, &head, &tail))
+		{
+			*ret = error_result(env, "not enough arguments");
+			return 0;
+		}
+
+		switch (method->inputs.params[i].type)
+		{
+		case TYPE_INT64:
+			if (!enif_get_int64(env, head, &input[i].integer64))
+			{
+				*ret = error_result(env, "parameter should be int64");
+				return 0;
+			}
+			break;
+		case TYPE_UINT64:
+			if (!enif_get_uint64(env, head, &input[i].uinteger64))
+			{
+				*ret = error_result(env, "parameter should be uint64");
+				return 0;
+			}
+			break;
+		case TYPE_DOUBLE:
+			if (!enif_get_double(env, head, &input[i].doubleval))
+			{
+				*ret = error_result(env, "parameter should be double");
+				return 0;
+			}
+			break;
+		// case TYPE_STRING:
+		case TYPE_BINARY:
+		{
+			ErlNifBinary erlbin;
+			if (!enif_inspect_binary(env, head, &erlbin))
+			{
+				*ret = error_result(env, "parameter should be binary");
+				return 0;
+			}
+			input[i].binary.size = erlbin.size;
+			input[i].binary.data = erlbin.data;
+			break;
+		}
+		case TYPE_ARRAY:
+			if (!decode_array(env, &method->inputs.params[i], head, &input[i].array, user_env))
+			{
+				*ret = error_result(env, "parameter should be a list or binary of the array type");
+				return 0;
+			}
+			break;
+		case TYPE_IOVEC:
+			if (!decode_iovec(env, head, &input[i].iovec, &user_env->iovecs[i], user_env))
+			{
+				*ret = error_result(env, "parameter should be iodata");
+				return 0;
+			}
+			break;
+		default:
+			*ret = error_result(env, "internal type error");
+			return 0;
+		}
+	}
+
+	return 1;
+}
+
+static int
+encode_output_list(ErlNifEnv *env, Method *method, Env *user_env, Param *output, ERL_NIF_TERM *ret)
+{
+	*ret = enif_make_list(env, 0);
+	for (int i = 0; i < method->outputs.size; i++)
+	{
+		ERL_NIF_TERM cell;
+		Param *param = output + i;
+
+		switch (method->outputs.params[i].type)
+		{
+		case TYPE_INT64:
+			cell = enif_make_int64(env, param->integer64);
+			break;
+		case TYPE_UINT64:
+			cell = enif_make_uint64(env, param->uinteger64);
+			break;
+		case TYPE_DOUBLE:
+			cell = enif_make_double(env, param->doubleval);
+			break;
+		// case TYPE_STRING:
+		case TYPE_BINARY:
+		{
+			if (param->binary.data == 0)
+			{
+				*ret = error_result(env, "no result binary provided");
+				return 0;
+			}
+
+			// Binaries from $ret_alloc() are handed over without a copy
+			ErlNifBinary *ret_bin = &user_env->ret[i];
+			if (ret_bin->data && ret_bin->data == param->binary.data &&
+				param->binary.size <= ret_bin->size)
+			{
+				if (param->binary.size < ret_bin->size &&
+					!enif_realloc_binary(ret_bin, param->binary.size))
+				{
+					*ret = error_result(env, "could not shrink result binary");
+					return 0;
+				}
+
+				cell = enif_make_binary(env, ret_bin);
+				memset(ret_bin, 0, sizeof(*ret_bin));
+				break;
+			}
+
+			if (param->binary.size == 0) {
+				param->binary.size = strlen(param->binary.data);
+			}
+
+			unsigned char *bin = enif_make_new_binary(env, param->binary.size, &cell);
+			if (!bin)
+			{
+				*ret = error_result(env, "could not allocate result binary");
+				return 0;
+			}
+
+			memcpy(bin, param->binary.data, param->binary.size);
+			break;
+		}
+		case TYPE_SLICE:
+		{
+			ERL_NIF_TERM head, tail = user_env->args;
+			for (int n = 0; n <= method->outputs.params[i].source; n++)
+				enif_get_list_cell(env, tail, &head, &tail);
+
+			ErlNifBinary source;
+			if (!enif_inspect_binary(env, head, &source))
+			{
+				*ret = error_result(env, "internal type error");
+				return 0;
+			}
+
+			if (param->slice.offset > source.size || param->slice.size > source.size - param->slice.offset)
+			{
+				*ret = error_result(env, "slice is out of the input binary bounds");
+				return 0;
+			}
+
+			cell = enif_make_sub_binary(env, head, param->slice.offset, param->slice.size);
+			break;
+		}
+		case TYPE_ARRAY:
+		{
+			if (param->array.data == 0 && param->array.size != 0)
+			{
+				*ret = error_result(env, "no result array provided");
+				return 0;
+			}
+
+			if (!encode_array(env, &method->outputs.params[i], &param->array, &user_env->ret[i], &cell))
+			{
+				*ret = error_result(env, "could not allocate result array");
+				return 0;
+			}
+			break;
+		}
+		default:
+			*ret = error_result(env, "internal type error");
+			return 0;
+		}
+		*ret = enif_make_list_cell(env, cell, *ret);
+	}
+
+	return 1;
+}
+
+static ERL_NIF_TERM run_continue(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[]);
+
+static unsigned stats_next_shard;
+// Shard of this thread plus one, 0 until the thread records its first call
+static __thread unsigned stats_shard;
+
+// Returns the statistics of a method in the shard of this thread. Threads
+// beyond the stats_shards ones counted on load use the shared last shard.
+static MethodStats *method_stats(Program *program, uint64_t method, int *shared)
+{
+	if (!stats_shard)
+		stats_shard = __atomic_fetch_add(&stats_next_shard, 1, __ATOMIC_RELAXED) + 1;
+
+	unsigned shard = stats_shard - 1;
+	*shared = shard >= program->stats_shards;
+	if (*shared)
+		shard = program->stats_shards;
+
+	MethodStats **slot = &program->run_stats[shard];
+	MethodStats *stats = __atomic_load_n(slot, __ATOMIC_ACQUIRE);
+	if (!stats)
+	{
+		stats = calloc(program->method_count, sizeof(MethodStats));
+		if (!stats)
+			return 0;
+		MethodStats *existing = 0;
+		if (!__atomic_compare_exchange_n(slot, &existing, stats, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+		{
+			free(stats);
+			stats = existing;
+		}
+	}
+	return stats + method;
+}
+
+// Bytes passed in binaries, slices, arrays and io vectors
+static uint64_t params_bytes(Params *params, Param *values)
+{
+	uint64_t bytes = 0;
+	for (unsigned sized = params->sized; sized; sized &= sized - 1)
+	{
+		int i = __builtin_ctz(sized);
+		Param *value = values + i;
+		switch (params->params[i].type)
+		{
+		case TYPE_BINARY:
+			bytes += value->binary.size;
+			break;
+		case TYPE_SLICE:
+			bytes += value->slice.size;
+			break;
+		case TYPE_ARRAY:
+			bytes += value->array.size * elem_size(params->params[i].elem);
+			break;
+		case TYPE_IOVEC:
+			for (uint64_t n = 0; n < value->iovec.size; n++)
+				bytes += value->iovec.data[n].size;
+			break;
+		}
+	}
+	return bytes;
+}
+
+static inline void stats_add(uint64_t *counter, uint64_t value, int shared)
+{
+	if (shared)
+		__atomic_fetch_add(counter, value, __ATOMIC_RELAXED);
+	else
+		*counter += value;
+}
+
+// Values below 4 have their own bucket, above that each power of two is split
+// into four buckets, like in an HDR histogram with two significant bits.
+static unsigned stats_bucket(uint64_t ns)
+{
+	if (ns < 4)
+		return ns;
+	unsigned exp = 63 - __builtin_clzll(ns);
+	unsigned bucket = (exp - 1) * 4 + ((ns >> (exp - 2)) & 3);
+	return bucket < STATS_BUCKETS ? bucket : STATS_BUCKETS - 1;
+}
+
+// Smallest value of a bucket
+static uint64_t stats_bucket_floor(unsigned bucket)
+{
+	if (bucket < 4)
+		return bucket;
+	return (uint64_t)(4 + bucket % 4) << (bucket / 4 - 1);
+}
+
+// Called before the first slice of a call. Fragments may modify their
+// inputs, so the input bytes are counted here.
+static void begin_call(Program *program, Env *user_env, Param *input)
+{
+	int shared;
+	MethodStats *stats = method_stats(program, user_env->method, &shared);
+	if (!stats)
+		return;
+
+	user_env->stats = stats;
+	user_env->stats_shard = stats_shard;
+	user_env->stats_shared = shared;
+	uint64_t calls = shared ? __atomic_fetch_add(&stats->calls, 1, __ATOMIC_RELAXED) : stats->calls++;
+	user_env->stats_timed = (calls & program->stats_mask) == 0;
+	if (user_env->stats_timed)
+		user_env->stats_start = enif_monotonic_time(ERL_NIF_NSEC);
+
+	stats_add(&stats->bytes_in, params_bytes(&program->methods[user_env->method].inputs, input), shared);
+}
+
+// Called once the outputs of a call are encoded, or it failed
+static void end_call(Program *program, Env *user_env, Param *output, int failed)
+{
+	MethodStats *stats = user_env->stats;
+	if (!stats)
+		return;
+
+	// Yielded calls may continue on another thread
+	int shared = user_env->stats_shared;
+	if (user_env->stats_shard != stats_shard && !(stats = method_stats(program, user_env->method, &shared)))
+		return;
+
+	if (failed)
+		stats_add(&stats->errors, 1, shared);
+	else
+		stats_add(&stats->bytes_out, params_bytes(&program->methods[user_env->method].outputs, output), shared);
+
+	if (!user_env->stats_timed)
+		return;
+
+	uint64_t ns = enif_monotonic_time(ERL_NIF_NSEC) - user_env->stats_start;
+	stats_add(&stats->samples, 1, shared);
+	stats_add(&stats->total_ns, ns, shared);
+	stats_add(&stats->histogram[stats_bucket(ns)], 1, shared);
+	if (!shared)
+	{
+		if (ns > stats->max_ns)
+			stats->max_ns = ns;
+	}
+	else
+	{
+		uint64_t max = __atomic_load_n(&stats->max_ns, __ATOMIC_RELAXED);
+		while (ns > max && !__atomic_compare_exchange_n(&stats->max_ns, &max, ns, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+			;
+	}
+}
+
+// Runs the fragment once and returns its error message, if any
+static const char *
+call(ErlNifEnv *env, Program *program, Env *user_env, Param *input, Param *output)
+{
+	if (program->run_stats && !user_env->stats)
+		begin_call(program, user_env, input);
+
+	user_env->nif_env = env;
+	user_env->output = output;
+	user_env->output_defs = program->methods[user_env->method].outputs.params;
+
+	if (!program->loop_budget)
+		return program->methods[user_env->method].runop(user_env, input, output);
+
+	const char *error;
+	jmp_buf abort;
+	user_env->abort = &abort;
+	current_env = user_env;
+	if (setjmp(abort))
+		error = "timeout";
+	else
+		error = program->methods[user_env->method].runop(user_env, input, output);
+	current_env = 0;
+	return error;
+}
+
+// Binaries of up to 64 bytes are stored on the process heap and may move when
+// the process is garbage collected between two slices of a yielding call.
+// Binaries are referenced in place, so on the first yield small ones are
+// copied into the arena and the pointers into them are moved along, keeping
+// any offset the fragment already advanced them by.
+#define HEAP_BINARY_MAX 64
+
+static void *
+rebase_pointer(void *ptr, ErlNifBinary *bin, unsigned char *copy)
+{
+	unsigned char *p = (unsigned char *)ptr;
+	if (p >= bin->data && p <= bin->data + bin->size)
+		return copy + (p - bin->data);
+	return ptr;
+}
+
+static int
+copy_heap_binaries(ErlNifEnv *env, Method *method, Env *user_env, Param *input)
+{
+	ERL_NIF_TERM head, tail = user_env->args;
+	for (int i = 0; i < method->inputs.size && enif_get_list_cell(env, tail, &head, &tail); i++)
+	{
+		int type = method->inputs.params[i].type;
+		ErlNifBinary bin;
+		if (type != TYPE_BINARY && type != TYPE_ARRAY && type != TYPE_IOVEC)
+			continue;
+		if (!enif_inspect_binary(env, head, &bin) || bin.size == 0 || bin.size > HEAP_BINARY_MAX)
+			continue;
+
+		unsigned char *copy = niffler_alloc_uninit(user_env, bin.size);
+		if (!copy)
+			return 0;
+		memcpy(copy, bin.data, bin.size);
+
+		switch (type)
+		{
+		case TYPE_BINARY:
+			input[i].binary.data = rebase_pointer(input[i].binary.data, &bin, copy);
+			break;
+		case TYPE_ARRAY:
+			input[i].array.data = rebase_pointer(input[i].array.data, &bin, copy);
+			break;
+		default:
+			if (input[i].iovec.size > 0 && input[i].iovec.data)
+				input[i].iovec.data[0].data = rebase_pointer(input[i].iovec.data[0].data, &bin, copy);
+			break;
+		}
+	}
+	return 1;
+}
+
+static ERL_NIF_TERM
+invoke(ErlNifEnv *env, Program *program, Method *method, Env *user_env, Param *input, Param *output, const ERL_NIF_TERM argv[])
+{
+	const char *error = call(env, program, user_env, input, output);
+
+	if (error == NIFFLER_YIELD)
+	{
+		if (!user_env->yieldable)
+		{
+			if (program->run_stats)
+				end_call(program, user_env, output, 1);
+			free_env(user_env);
+			return error_result(env, "yield outside of a yieldable context");
+		}
+
+		// The first yield moves the call state from the stack into a
+		// continuation, later yields just reschedule that continuation.
+		ERL_NIF_TERM cont_term;
+		if (user_env->continuation)
+		{
+			cont_term = argv[3];
+		}
+		else
+		{
+			if (!copy_heap_binaries(env, method, user_env, input))
+			{
+				if (program->run_stats)
+					end_call(program, user_env, output, 1);
+				free_env(user_env);
+				return error_result(env, "out of memory");
+			}
+
+			Continuation *cont = enif_alloc_resource(CONTINUATION_TYPE, sizeof(Continuation));
+			detach_arena(user_env);
+			cont->env = *user_env;
+			cont->env.continuation = cont;
+			memcpy(cont->input, input, sizeof(Param) * method->inputs.size);
+			memcpy(cont->output, output, sizeof(Param) * method->outputs.size);
+			cont_term = enif_make_resource(env, cont);
+			enif_release_resource(cont);
+		}
+
+		ERL_NIF_TERM args[4] = {argv[0], argv[1], argv[2], cont_term};
+		return enif_schedule_nif(env, "nif_run", 0, run_continue, 4, args);
+	}
+
+	ERL_NIF_TERM ret;
+	int ok = !error && encode_output_list(env, method, user_env, output, &ret);
+	if (error)
+		ret = error_result(env, error);
+	else if (ok)
+		ret = ok_result(env, ret);
+
+	if (program->run_stats)
+		end_call(program, user_env, output, !ok);
+	free_env(user_env);
+	return ret;
+}
+
+static ERL_NIF_TERM
+execute(ErlNifEnv *env, Program *program, uint64_t method_index, const ERL_NIF_TERM argv[])
+{
+	Method *method = &program->methods[method_index];
+
+	Param *input = alloca(sizeof(Param) * method->inputs.size);
+	Param *output = alloca(sizeof(Param) * method->outputs.size);
+	memset(output, 0, sizeof(Param) * method->outputs.size);
+	// Param input[MAX_ARGS] = {};
+	// Param output[MAX_ARGS] = {};
+
+	Env user_env;
+	init_env(&user_env, method_index, !method->dirty);
+	user_env.args = argv[2];
 
-	for (unsigned i = 0; i < size; i++)
+	ERL_NIF_TERM ret;
+	if (!decode_inputs(env, method, argv[2], input, &user_env, &ret))
 	{
-		ERL_NIF_TERM head;
-		if (!enif_get_list_cell(env, method_list, &head, &method_list)) 
-			return error_result(env, "could get method list element");
+		free_env(&user_env);
+		return ret;
+	}
 
-		int arity;
-		const ERL_NIF_TERM* tuple;
-		if (!enif_get_tuple(env, head, &arity, &tuple) || arity != 2) 
-			return error_result(env, "method list element is not a 2-element tuple");
+	if (program->timeout)
+		user_env.deadline = enif_monotonic_time(ERL_NIF_USEC) + program->timeout * 1000;
+	return invoke(env, program, method, &user_env, input, output, argv);
+}
 
+static int
+get_method(ErlNifEnv *env, const ERL_NIF_TERM argv[], Program **program, uint64_t *method_index, ERL_NIF_TERM *ret)
+{
+	if (!enif_get_resource(env, argv[0], PROGRAM_TYPE, (void *)program))
+	{
+		*ret = enif_make_badarg(env);
+		return 0;
+	}
 
-		ERL_NIF_TERM ret = error_result(env, "failed to scan input parameters");
-		methods[i].inputs = scan_params(env, tuple[0], &ret);
-		if (methods[i].inputs.size < 0)
-		{
-			free_methods(methods, size);
-			return ret;
-		}
-		ret = error_result(env, "failed to scan output parameters");
-		methods[i].outputs = scan_params(env, tuple[1], &ret);
-		if (methods[i].outputs.size < 0)
-		{
-			free_methods(methods, size);
-			return ret;
-		}
+	if (!enif_get_uint64(env, argv[1], method_index))
+	{
+		*ret = error_result(env, "method index must be an int");
+		return 0;
 	}
 
-	state = tcc_new();
-	if (!state)
+	if (*method_index >= (*program)->method_count)
 	{
-		free_methods(methods, size);
-		return error_result(env, "could not initiate tcc state");
+		*ret = error_result(env, "method index out of bounds");
+		return 0;
 	}
 
-	Program *program = enif_alloc_resource(PROGRAM_TYPE, sizeof(Program));
-	program->state = state;
-	program->methods = methods;
-	program->method_count = size;
+	return 1;
+}
 
-	ERL_NIF_TERM term = enif_make_resource(env, program);
-	enif_release_resource(program);
+static ERL_NIF_TERM
+run_dirty(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
+{
+	Program *program;
+	uint64_t method_index;
+	ERL_NIF_TERM ret;
 
-	if (tcc_set_output_type(state, TCC_OUTPUT_MEMORY) != 0)
-		return error_result(env, "could not set tcc output type");
+	if (!get_method(env, argv, &program, &method_index, &ret))
+		return ret;
 
-	if (tcc_compile_string(state, (const char *)sourcecode.data) != 0)
-		return error_result(env, "compilation error");
+	return execute(env, program, method_index, argv);
+}
 
-	#define X(name) tcc_add_symbol(state, #name, name);
-	#include "symbols.def"
-	#undef X
+static ERL_NIF_TERM
+run_continue(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
+{
+	Program *program;
+	uint64_t method_index;
+	Continuation *cont;
+	ERL_NIF_TERM ret;
 
-	tcc_set_options(state, "-nostdlib");
-	if (tcc_relocate(state, TCC_RELOCATE_AUTO) != 0)
-		return error_result(env, "could not relocate program");
+	if (!get_method(env, argv, &program, &method_index, &ret))
+		return ret;
 
-	program->runop = tcc_get_symbol(program->state, "run");
-	if (!program->runop)
-		return error_result(env, " run is undefined");
+	if (!enif_get_resource(env, argv[3], CONTINUATION_TYPE, (void *)&cont))
+		return enif_make_badarg(env);
 
-	return ok_result(env, term);
+	Method *method = &program->methods[method_index];
+	cont->env.slice_start = 0;
+	cont->env.args = argv[2];
+	return invoke(env, program, method, &cont->env, cont->input, cont->output, argv);
 }
 
-static void free_state(ErlNifEnv *env, void *obj)
+static void free_job(Job *job)
 {
-	Program *program = (Program *)obj;
-	tcc_delete(program->state);
-	free_methods(program->methods, program->method_count);
+	free_env(&job->env);
+	enif_free_env(job->msg_env);
+	enif_release_resource(job->program);
+	free(job);
 }
 
-static ERL_NIF_TERM
-run(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
+static void run_job(Job *job)
 {
-	Program *program;
+	Program *program = job->program;
+	Method *method = &program->methods[job->method_index];
+	Param output[MAX_ARGS];
+	memset(output, 0, sizeof(Param) * method->outputs.size);
 
-	if (!enif_get_resource(env, argv[0], PROGRAM_TYPE, (void *)&program))
-		return enif_make_badarg(env);
+	Env *user_env = &job->env;
+	user_env->no_arena = 0;
+	if (program->timeout)
+		user_env->deadline = enif_monotonic_time(ERL_NIF_USEC) + program->timeout * 1000;
 
-	uint64_t method_index;
-	if (!enif_get_uint64(env, argv[1], &method_index))
-		return error_result(env, "method index must be an int");
+	ERL_NIF_TERM result = invoke(job->msg_env, program, method, user_env, job->input, output, 0);
+	enif_send(0, &job->pid, job->msg_env, enif_make_tuple2(job->msg_env, job->ref, result));
+	free_job(job);
+}
 
-	if (method_index >= program->method_count)
-		return error_result(env, "method index out of bounds");
+static void *pool_worker(void *arg)
+{
+	for (;;)
+	{
+		enif_mutex_lock(pool.lock);
+		while (!pool.head && !pool.stopping)
+			enif_cond_wait(pool.cond, pool.lock);
 
-	Method *method = &program->methods[method_index];
+		if (pool.stopping)
+		{
+			enif_mutex_unlock(pool.lock);
+			free(thread_arena);
+			thread_arena = 0;
+			return 0;
+		}
 
-	Param *input = alloca(sizeof(Param) * method->inputs.size);
-	Param *output = alloca(sizeof(Param) * method->outputs.size);
-	memset(output, 0, sizeof(Param) * method->outputs.size);
-	// Param input[MAX_ARGS] = {};
-	// Param output[MAX_ARGS] = {};
+		Job *job = pool.head;
+		pool.head = job->next;
+		if (!pool.head)
+			pool.tail = 0;
+		enif_mutex_unlock(pool.lock);
 
-	ERL_NIF_TERM head, tail = argv[2];
-	for (int i = 0; i < method->inputs.size; i++)
-	{
-		if (!enif_get_list_cell(env, tail, &head, &tail))
-			return error_result(env, "not enough arguments");
+		run_job(job);
+	}
+}
 
-		switch (method->inputs.params[i].type)
-		{
-		case TYPE_INT64:
-			if (!enif_get_int64(env, head, &input[i].integer64))
-				return error_result(env, "parameter should be int64");
-			break;
-		case TYPE_UINT64:
-			if (!enif_get_uint64(env, head, &input[i].uinteger64))
-				return error_result(env, "parameter should be uint64");
-			break;
-		case TYPE_DOUBLE:
-			if (!enif_get_double(env, head, &input[i].doubleval))
-				return error_result(env, "parameter should be double");
-			break;
-		// case TYPE_STRING:
-		case TYPE_BINARY:
-		{
-			ErlNifBinary erlbin;
-			if (!enif_inspect_binary(env, head, &erlbin))
-				return error_result(env, "parameter should be binary");
-			input[i].binary.size = erlbin.size;
-			input[i].binary.data = erlbin.data;
+// Called with pool.lock held
+static int pool_start(void)
+{
+	ErlNifSysInfo info;
+	enif_system_info(&info, sizeof(info));
+	int count = info.scheduler_threads > 0 ? info.scheduler_threads : 1;
+
+	pool.threads = malloc(sizeof(ErlNifTid) * count);
+	if (!pool.threads)
+		return 0;
+
+	ErlNifThreadOpts *opts = enif_thread_opts_create("niffler_async");
+	if (opts)
+		opts->suggested_stack_size = POOL_STACK_SIZE;
+
+	for (int i = 0; i < count; i++)
+	{
+		if (enif_thread_create("niffler_async", &pool.threads[pool.thread_count], pool_worker, 0, opts) != 0)
 			break;
-		}
-		default:
-			return error_result(env, "internal type error");
-		}
+		pool.thread_count++;
 	}
 
-	Env user_env;
-	user_env.method = method_index;
-	user_env.head = 0;
-	const char *error = program->runop(&user_env, input, output);
-	if (error)
+	if (opts)
+		enif_thread_opts_destroy(opts);
+	return pool.thread_count > 0;
+}
+
+static int pool_push(Job *job)
+{
+	enif_mutex_lock(pool.lock);
+	if (!pool.thread_count && !pool_start())
 	{
-		free_env(&user_env);
-		return error_result(env, error);
+		enif_mutex_unlock(pool.lock);
+		return 0;
 	}
 
-	ERL_NIF_TERM ret = enif_make_list(env, 0);
-	for (int i = 0; i < method->outputs.size; i++)
+	if (pool.tail)
+		pool.tail->next = job;
+	else
+		pool.head = job;
+	pool.tail = job;
+
+	enif_cond_signal(pool.cond);
+	enif_mutex_unlock(pool.lock);
+	return 1;
+}
+
+static ERL_NIF_TERM
+submit(ErlNifEnv *env, Program *program, uint64_t method_index, const ERL_NIF_TERM argv[])
+{
+	Method *method = &program->methods[method_index];
+	Job *job = malloc(sizeof(Job));
+	if (!job)
+		return error_result(env, "could not allocate async job");
+
+	memset(job, 0, sizeof(Job));
+	job->msg_env = enif_alloc_env();
+	if (!job->msg_env)
 	{
-		ERL_NIF_TERM cell;
-		Param *param = output + i;
+		free(job);
+		return error_result(env, "could not allocate async job");
+	}
 
-		switch (method->outputs.params[i].type)
+	// Copying the arguments into the job env only references the input
+	// binaries, so they stay valid after this call has returned.
+	ERL_NIF_TERM ret;
+	job->args = enif_make_copy(job->msg_env, argv[2]);
+
+	// Pool threads are not schedulers, so there is nothing to yield to.
+	// Inputs decoded here can't use the arena of this thread.
+	init_env(&job->env, method_index, 0);
+	job->env.args = job->args;
+	job->env.no_arena = 1;
+	if (!decode_inputs(job->msg_env, method, job->args, job->input, &job->env, &ret))
+	{
+		ret = enif_make_copy(env, ret);
+		free_env(&job->env);
+		enif_free_env(job->msg_env);
+		free(job);
+		return ret;
+	}
+
+	ERL_NIF_TERM ref = enif_make_ref(env);
+	job->ref = enif_make_copy(job->msg_env, ref);
+	enif_self(env, &job->pid);
+	enif_keep_resource(program);
+	job->program = program;
+	job->method_index = method_index;
+
+	if (!pool_push(job))
+	{
+		free_job(job);
+		return error_result(env, "could not start async threads");
+	}
+
+	return ref;
+}
+
+static ERL_NIF_TERM
+run(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
+{
+	Program *program;
+	uint64_t method_index;
+	ERL_NIF_TERM ret;
+
+	if (!get_method(env, argv, &program, &method_index, &ret))
+		return ret;
+
+	if (program->methods[method_index].async)
+		return submit(env, program, method_index, argv);
+
+	// Long running methods are moved off the normal scheduler, everything
+	// else is executed directly without any extra indirection.
+	int dirty = program->methods[method_index].dirty;
+	if (dirty)
+		return enif_schedule_nif(env, "nif_run", dirty, run_dirty, argc, argv);
+
+	return execute(env, program, method_index, argv);
+}
+
+static ERL_NIF_TERM run_batch_continue(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[]);
+
+// Executes the method for each argument list in `list`, prepending the outputs to `acc`.
+// Batches on normal schedulers are split into chunks that fit the timeslice.
+static ERL_NIF_TERM
+batch(ErlNifEnv *env, Program *program, uint64_t method_index, ERL_NIF_TERM list, ERL_NIF_TERM acc, const ERL_NIF_TERM argv[])
+{
+	Method *method = &program->methods[method_index];
+	int yieldable = !method->dirty;
+	ErlNifTime slice_start = enif_monotonic_time(ERL_NIF_USEC);
+	Param input[MAX_ARGS];
+	Param output[MAX_ARGS];
+	Env user_env;
+	ERL_NIF_TERM head, ret;
+	unsigned count = 0;
+
+	while (enif_get_list_cell(env, list, &head, &list))
+	{
+		init_env(&user_env, method_index, 0);
+		user_env.args = head;
+		if (!decode_inputs(env, method, head, input, &user_env, &ret))
 		{
-		case TYPE_INT64:
-			cell = enif_make_int64(env, param->integer64);
-			break;
-		case TYPE_UINT64:
-			cell = enif_make_uint64(env, param->uinteger64);
-			break;
-		case TYPE_DOUBLE:
-			cell = enif_make_double(env, param->doubleval);
-			break;
-		// case TYPE_STRING:
-		case TYPE_BINARY:
+			free_env(&user_env);
+			return ret;
+		}
+
+		memset(output, 0, sizeof(Param) * method->outputs.size);
+		if (program->timeout)
+			user_env.deadline = enif_monotonic_time(ERL_NIF_USEC) + program->timeout * 1000;
+
+		const char *error = call(env, program, &user_env, input, output);
+		if (error == NIFFLER_YIELD)
+			error = "yield outside of a yieldable context";
+
+		int ok = !error && encode_output_list(env, method, &user_env, output, &ret);
+		if (error)
+			ret = error_result(env, error);
+		if (program->run_stats)
+			end_call(program, &user_env, output, !ok);
+		free_env(&user_env);
+		if (!ok)
+			return ret;
+
+		acc = enif_make_list_cell(env, ret, acc);
+
+		if (!yieldable || ++count % BATCH_INTERVAL != 0)
+			continue;
+
+		ErlNifTime now = enif_monotonic_time(ERL_NIF_USEC);
+		int percent = (int)((now - slice_start) * 100 / TIMESLICE_USEC);
+		if (percent < 1)
+			continue;
+
+		slice_start = now;
+		if (enif_consume_timeslice(env, percent > 100 ? 100 : percent))
 		{
-			if (param->binary.data == 0)
-			{
-				free_env(&user_env);
-				return error_result(env, "no result binary provided");
-			}
+			ERL_NIF_TERM args[4] = {argv[0], argv[1], list, acc};
+			return enif_schedule_nif(env, "nif_run_batch", 0, run_batch_continue, 4, args);
+		}
+	}
 
-			if (param->binary.size == 0) {
-				param->binary.size = strlen(param->binary.data);
-			}
+	if (!enif_is_empty_list(env, list))
+		return error_result(env, "batch arguments are not a list");
 
-			unsigned char *bin = enif_make_new_binary(env, param->binary.size, &cell);
-			if (!bin)
-			{
-				free_env(&user_env);
-				return error_result(env, "could not allocate result binary");
-			}
+	enif_make_reverse_list(env, acc, &ret);
+	return ok_result(env, ret);
+}
 
-			memcpy(bin, param->binary.data, param->binary.size);
-			break;
+static ERL_NIF_TERM
+run_batch_continue(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
+{
+	Program *program;
+	uint64_t method_index;
+	ERL_NIF_TERM ret;
+
+	if (!get_method(env, argv, &program, &method_index, &ret))
+		return ret;
+
+	ERL_NIF_TERM acc = argc > 3 ? argv[3] : enif_make_list(env, 0);
+	return batch(env, program, method_index, argv[2], acc, argv);
+}
+
+static ERL_NIF_TERM
+run_batch(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
+{
+	Program *program;
+	uint64_t method_index;
+	ERL_NIF_TERM ret;
+
+	if (!get_method(env, argv, &program, &method_index, &ret))
+		return ret;
+
+	int dirty = program->methods[method_index].dirty;
+	if (dirty)
+		return enif_schedule_nif(env, "nif_run_batch", dirty, run_batch_continue, argc, argv);
+
+	return batch(env, program, method_index, argv[2], enif_make_list(env, 0), argv);
+}
+
+static ERL_NIF_TERM
+arena_stats(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
+{
+	return enif_make_tuple3(env,
+							enif_make_uint64(env, __atomic_load_n(&arena_high_water, __ATOMIC_RELAXED)),
+							enif_make_uint64(env, __atomic_load_n(&arena_spills, __ATOMIC_RELAXED)),
+							enif_make_uint64(env, __atomic_load_n(&arena_spill_bytes, __ATOMIC_RELAXED)));
+}
+
+static ERL_NIF_TERM
+cache_stats(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
+{
+	enif_mutex_lock(cache.lock);
+	ERL_NIF_TERM ret = enif_make_tuple4(env,
+										enif_make_uint64(env, cache.hits),
+										enif_make_uint64(env, cache.misses),
+										enif_make_uint64(env, cache.evictions),
+										enif_make_uint(env, cache.size));
+	enif_mutex_unlock(cache.lock);
+	return ret;
+}
+
+static ERL_NIF_TERM
+memory_info(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
+{
+	Program *program;
+	if (!enif_get_resource(env, argv[0], PROGRAM_TYPE, (void *)&program))
+		return enif_make_badarg(env);
+
+	size_t retained = program_metadata_size(program) + program->code_size;
+	size_t state = program->state ? tcc_memory_usage(program->state) : 0;
+	return enif_make_tuple3(env,
+							enif_make_uint64(env, program->code_size),
+							enif_make_uint64(env, retained + program->state_size),
+							enif_make_uint64(env, retained + state));
+}
+
+static ERL_NIF_TERM
+compile_stats(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
+{
+	Program *program;
+	if (!enif_get_resource(env, argv[0], PROGRAM_TYPE, (void *)&program))
+		return enif_make_badarg(env);
+
+	CompileStats *stats = &program->stats;
+	ERL_NIF_TERM values[] = {
+		enif_make_int64(env, stats->compile),
+		enif_make_int64(env, stats->link),
+		enif_make_int64(env, stats->relocate),
+		enif_make_int64(env, stats->total),
+		enif_make_uint64(env, stats->counts.tokens),
+		enif_make_uint64(env, stats->counts.symbols),
+		enif_make_uint64(env, stats->counts.relocations),
+		enif_make_uint64(env, stats->code_bytes),
+		enif_make_uint64(env, stats->pages),
+	};
+	return enif_make_tuple_from_array(env, values, sizeof(values) / sizeof(ERL_NIF_TERM));
+}
+
+static ERL_NIF_TERM
+run_stats(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
+{
+	Program *program;
+	if (!enif_get_resource(env, argv[0], PROGRAM_TYPE, (void *)&program))
+		return enif_make_badarg(env);
+
+	if (!program->run_stats)
+		return enif_make_atom(env, "nil");
+
+	// Shards are summed up while they are being written, so the values of
+	// calls running at the same time may be missing or partial.
+	ERL_NIF_TERM methods = enif_make_list(env, 0);
+	for (unsigned m = program->method_count; m-- > 0;)
+	{
+		MethodStats sum;
+		memset(&sum, 0, sizeof(sum));
+		for (unsigned i = 0; i <= program->stats_shards; i++)
+		{
+			MethodStats *shard = __atomic_load_n(&program->run_stats[i], __ATOMIC_ACQUIRE);
+			if (!shard)
+				continue;
+			shard += m;
+			sum.calls += shard->calls;
+			sum.errors += shard->errors;
+			sum.bytes_in += shard->bytes_in;
+			sum.bytes_out += shard->bytes_out;
+			sum.samples += shard->samples;
+			sum.total_ns += shard->total_ns;
+			if (shard->max_ns > sum.max_ns)
+				sum.max_ns = shard->max_ns;
+			for (unsigned b = 0; b < STATS_BUCKETS; b++)
+				sum.histogram[b] += shard->histogram[b];
 		}
-		default:
-			free_env(&user_env);
-			return error_result(env, "internal type error");
+
+		// Only the buckets with samples as {smallest value, count}
+		ERL_NIF_TERM histogram = enif_make_list(env, 0);
+		for (unsigned b = STATS_BUCKETS; b-- > 0;)
+		{
+			if (!sum.histogram[b])
+				continue;
+			ERL_NIF_TERM bucket = enif_make_tuple2(env, enif_make_uint64(env, stats_bucket_floor(b)),
+												   enif_make_uint64(env, sum.histogram[b]));
+			histogram = enif_make_list_cell(env, bucket, histogram);
 		}
-		ret = enif_make_list_cell(env, cell, ret);
+
+		ERL_NIF_TERM values[] = {
+			enif_make_uint64(env, sum.calls),
+			enif_make_uint64(env, sum.errors),
+			enif_make_uint64(env, sum.bytes_in),
+			enif_make_uint64(env, sum.bytes_out),
+			enif_make_uint64(env, sum.samples),
+			enif_make_uint64(env, sum.total_ns),
+			enif_make_uint64(env, sum.max_ns),
+			histogram,
+		};
+		methods = enif_make_list_cell(env, enif_make_tuple_from_array(env, values, sizeof(values) / sizeof(ERL_NIF_TERM)), methods);
 	}
+	return methods;
+}
 
-	free_env(&user_env);
-	return ok_result(env, ret);
+static ERL_NIF_TERM
+set_huge_pages(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
+{
+	// Applies to chunks mapped from now on, a changed setting retires the current chunk
+	int huge_pages = enif_is_identical(argv[0], enif_make_atom(env, "true"));
+	enif_mutex_lock(heap.lock);
+	if (heap.huge_pages != huge_pages && heap.chunks)
+		heap.chunks->used = HEAP_CHUNK_SIZE;
+	heap.huge_pages = huge_pages;
+	enif_mutex_unlock(heap.lock);
+	return enif_make_atom(env, "ok");
 }
 
 static ERL_NIF_TERM error_result(ErlNifEnv *env, const char *error_msg)
@@ -483,8 +3291,24 @@ static ERL_NIF_TERM ok_result(ErlNifEnv *env, ERL_NIF_TERM ret)
 	return enif_make_tuple2(env, enif_make_atom(env, "ok"), ret);
 }
 
+// `compiled` is false when the program was taken from the cache
+static ERL_NIF_TERM compile_result(ErlNifEnv *env, ERL_NIF_TERM program, int compiled)
+{
+	return enif_make_tuple3(env, enif_make_atom(env, "ok"), program,
+							enif_make_atom(env, compiled ? "true" : "false"));
+}
+
+// Compiling and relocating takes milliseconds for larger programs, too long
+// for a normal scheduler.
 static ErlNifFunc nif_funcs[] = {
-	{"nif_compile", 2, compile},
-	{"nif_run", 3, run}};
+	{"nif_compile", 3, compile, ERL_NIF_DIRTY_JOB_CPU_BOUND},
+	{"nif_run", 3, run},
+	{"nif_run_batch", 3, run_batch},
+	{"nif_arena_stats", 0, arena_stats},
+	{"nif_cache_stats", 0, cache_stats},
+	{"nif_memory_info", 1, memory_info},
+	{"nif_compile_stats", 1, compile_stats},
+	{"nif_run_stats", 1, run_stats},
+	{"nif_set_huge_pages", 1, set_huge_pages}};
 
 ERL_NIF_INIT(Elixir.Niffler, nif_funcs, &load, NULL, &upgrade, &unload);
@@ -141,7 +141,7 @@ enum {
 #define USING_GLOBALS
 #include "tcc.h"
 
-ST_DATA const char * const target_machine_defs =
+ST_RODATA const char * const target_machine_defs =
     "__arm__\0"
     "__arm\0"
     "arm\0"
@@ -156,9 +156,9 @@ ST_DATA const char * const target_machine_defs =
 #endif
     ;
 
-enum float_abi float_abi;
+ST_TLS enum float_abi float_abi;
 
-ST_DATA const int reg_classes[NB_REGS] = {
+ST_RODATA const int reg_classes[NB_REGS] = {
     /* r0 */ RC_INT | RC_R0,
     /* r1 */ RC_INT | RC_R1,
     /* r2 */ RC_INT | RC_R2,
@@ -176,17 +176,17 @@ ST_DATA const int reg_classes[NB_REGS] = {
 #endif
 };
 
-static int func_sub_sp_offset, last_itod_magic;
-static int leaffunc;
+static ST_TLS int func_sub_sp_offset, last_itod_magic;
+static ST_TLS int leaffunc;
 
 #if defined(CONFIG_TCC_BCHECK)
-static addr_t func_bound_offset;
-static unsigned long func_bound_ind;
+static ST_TLS addr_t func_bound_offset;
+static ST_TLS unsigned long func_bound_ind;
 ST_DATA int func_bound_add_epilog;
 #endif
 
 #if defined(TCC_ARM_EABI) && defined(TCC_ARM_VFP)
-static CType float_type, double_type, func_float_type, func_double_type;
+static ST_TLS CType float_type, double_type, func_float_type, func_double_type;
 ST_FUNC void arm_init(struct TCCState *s)
 {
     float_type.t = VT_FLOAT;
@@ -50,7 +50,7 @@
 #include "tcc.h"
 #include <assert.h>
 
-ST_DATA const char * const target_machine_defs =
+ST_RODATA const char * const target_machine_defs =
 #if defined(__APPLE__)
     "__aarch64__\0"
     "__arm64__\0"
@@ -59,7 +59,7 @@ ST_DATA const char * const target_machine_defs =
 #endif
     ;
 
-ST_DATA const int reg_classes[NB_REGS] = {
+ST_RODATA const int reg_classes[NB_REGS] = {
   RC_INT | RC_R(0),
   RC_INT | RC_R(1),
   RC_INT | RC_R(2),
@@ -91,8 +91,8 @@ ST_DATA const int reg_classes[NB_REGS] = {
 };
 
 #if defined(CONFIG_TCC_BCHECK)
-static addr_t func_bound_offset;
-static unsigned long func_bound_ind;
+static ST_TLS addr_t func_bound_offset;
+static ST_TLS unsigned long func_bound_ind;
 ST_DATA int func_bound_add_epilog;
 #endif
 
@@ -1147,10 +1147,10 @@ ST_FUNC void gfunc_call(int nb_args)
     tcc_free(t);
 }
 
-static unsigned long arm64_func_va_list_stack;
-static int arm64_func_va_list_gr_offs;
-static int arm64_func_va_list_vr_offs;
-static int arm64_func_sub_sp_offset;
+static ST_TLS unsigned long arm64_func_va_list_stack;
+static ST_TLS int arm64_func_va_list_gr_offs;
+static ST_TLS int arm64_func_va_list_vr_offs;
+static ST_TLS int arm64_func_sub_sp_offset;
 
 ST_FUNC void gfunc_prolog(Sym *func_sym)
 {
@@ -116,11 +116,11 @@ enum {
 #define USING_GLOBALS
 #include "tcc.h"
 
-ST_DATA const char * const target_machine_defs =
+ST_RODATA const char * const target_machine_defs =
     "__C67__\0"
     ;
 
-ST_DATA const int reg_classes[NB_REGS] = {
+ST_RODATA const int reg_classes[NB_REGS] = {
     /* eax */ RC_INT | RC_FLOAT | RC_EAX,
     // only allow even regs for floats (allow for doubles)
     /* ecx */ RC_INT | RC_ECX,
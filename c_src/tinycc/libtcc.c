@@ -701,10 +701,9 @@ static int tcc_compile(TCCState *s1, int filetype, const char *str, int fd)
 {
     /* Here we enter the code section where we use the global variables for
        parsing and code generation (tccpp.c, tccgen.c, <target>-gen.c).
-       Other threads need to wait until we're done.
-
-       Alternatively we could use thread local storage for those global
-       variables, which may or may not have advantages */
+       With CONFIG_TCC_THREADLOCAL those globals are thread local and other
+       threads can compile concurrently, otherwise they need to wait until
+       we're done. */
 
     tcc_enter_state(s1);
 
@@ -767,6 +766,11 @@ LIBTCCAPI void tcc_undefine_symbol(TCCState *s1, const char *sym)
     cstr_printf(&s1->cmdline_defs, "#undef %s\n", sym);
 }
 
+LIBTCCAPI void tcc_set_prelude(TCCState *s1, const char *str)
+{
+    tcc_free(s1->prelude);
+    s1->prelude = str ? tcc_strdup(str) : NULL;
+}
 
 LIBTCCAPI TCCState *tcc_new(void)
 {
@@ -821,6 +825,7 @@ LIBTCCAPI void tcc_delete(TCCState *s1)
 {
     /* free sections */
     tccelf_delete(s1);
+    tccelf_free_spare(s1);
 
     /* free library paths */
     dynarray_reset(&s1->library_paths, &s1->nb_library_paths);
@@ -843,6 +848,7 @@ LIBTCCAPI void tcc_delete(TCCState *s1)
     dynarray_reset(&s1->argv, &s1->argc);
     cstr_free(&s1->cmdline_defs);
     cstr_free(&s1->cmdline_incl);
+    tcc_free(s1->prelude);
 #ifdef TCC_IS_NATIVE
     /* free runtime memory */
     tcc_run_free(s1);
@@ -855,6 +861,21 @@ LIBTCCAPI void tcc_delete(TCCState *s1)
 #endif
 }
 
+LIBTCCAPI void tcc_reset(TCCState *s1)
+{
+#ifdef TCC_IS_NATIVE
+    tcc_run_free(s1);
+    s1->runtime_mem = NULL;
+    s1->nb_runtime_mem = 0;
+#endif
+    tccelf_reset(s1);
+    dynarray_reset(&s1->target_deps, &s1->nb_target_deps);
+    dynarray_reset(&s1->pragma_libs, &s1->nb_pragma_libs);
+    s1->nb_errors = 0;
+    total_idents = total_tokens = total_lines = total_bytes = 0;
+    memset(s1->total_output, 0, sizeof s1->total_output);
+}
+
 LIBTCCAPI int tcc_set_output_type(TCCState *s, int output_type)
 {
     s->output_type = output_type;
@@ -1175,6 +1196,12 @@ ST_FUNC void tcc_add_pragma_libs(TCCState *s1)
         tcc_add_library_err(s1, s1->pragma_libs[i]);
 }
 
+LIBTCCAPI void tcc_set_resolve_func(TCCState *s1, void *resolve_opaque, TCCResolveFunc resolve_func)
+{
+    s1->resolve_opaque = resolve_opaque;
+    s1->resolve_func = resolve_func;
+}
+
 LIBTCCAPI int tcc_add_symbol(TCCState *s1, const char *name, const void *val)
 {
 #ifdef TCC_TARGET_PE
@@ -1596,6 +1623,7 @@ static const FlagDef options_f[] = {
     { offsetof(TCCState, ms_extensions), 0, "ms-extensions" },
     { offsetof(TCCState, dollars_in_identifiers), 0, "dollars-in-identifiers" },
     { offsetof(TCCState, test_coverage), 0, "test-coverage" },
+    { offsetof(TCCState, loop_budget), 0, "loop-budget" },
     { 0, 0, NULL }
 };
 
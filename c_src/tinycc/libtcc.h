@@ -15,12 +15,19 @@ typedef struct TCCState TCCState;
 
 typedef void (*TCCErrorFunc)(void *opaque, const char *msg);
 
+typedef void *(*TCCResolveFunc)(void *opaque, const char *name);
+
 /* create a new TCC compilation context */
 LIBTCCAPI TCCState *tcc_new(void);
 
 /* free a TCC compilation context */
 LIBTCCAPI void tcc_delete(TCCState *s);
 
+/* make a context ready for another compilation with the same options and
+   output type, after tcc_relocate() or an error. Memory for sections is kept
+   for reuse. */
+LIBTCCAPI void tcc_reset(TCCState *s);
+
 /* set CONFIG_TCCDIR at runtime */
 LIBTCCAPI void tcc_set_lib_path(TCCState *s, const char *path);
 
@@ -51,6 +58,20 @@ LIBTCCAPI void tcc_define_symbol(TCCState *s, const char *sym, const char *value
 /* undefine preprocess symbol 'sym' */
 LIBTCCAPI void tcc_undefine_symbol(TCCState *s, const char *sym);
 
+/* set declarations and macros that precede every compiled source. The prelude
+   is parsed once per thread, later compiles with the same prelude and options
+   start from a snapshot of its macros, types and declarations. It must not
+   define functions or data. */
+LIBTCCAPI void tcc_set_prelude(TCCState *s, const char *str);
+
+/* the prelude snapshot and the spare allocators stay with the thread after
+   tcc_delete(). tcc_thread_data() returns them for the calling thread and
+   tcc_free_thread_data() frees them, also from another thread as long as
+   the owner does not compile at the same time. */
+typedef struct TCCThreadData TCCThreadData;
+LIBTCCAPI TCCThreadData *tcc_thread_data(void);
+LIBTCCAPI void tcc_free_thread_data(TCCThreadData *td);
+
 /*****************************/
 /* compiling */
 
@@ -60,6 +81,12 @@ LIBTCCAPI int tcc_add_file(TCCState *s, const char *filename);
 /* compile a string containing a C source. Return -1 if error. */
 LIBTCCAPI int tcc_compile_string(TCCState *s, const char *buf);
 
+/* make the global symbols defined so far local, except those for which
+   'keep_cb' returns nonzero. Sources compiled afterwards can define the
+   same names again, as if each source had a namespace of its own. */
+LIBTCCAPI void tcc_localize_symbols(TCCState *s, void *ctx,
+    int (*keep_cb)(void *ctx, const char *name));
+
 /*****************************/
 /* linking commands */
 
@@ -80,6 +107,11 @@ LIBTCCAPI int tcc_add_library(TCCState *s, const char *libraryname);
 /* add a symbol to the compiled program */
 LIBTCCAPI int tcc_add_symbol(TCCState *s, const char *name, const void *val);
 
+/* set a function that resolves undefined symbols at tcc_relocate(), before
+   they are looked up in the process. It returns NULL for unknown symbols.
+   Not supported on Windows, use tcc_add_symbol() there. */
+LIBTCCAPI void tcc_set_resolve_func(TCCState *s, void *resolve_opaque, TCCResolveFunc resolve_func);
+
 /* output an executable, library or object file. DO NOT call
    tcc_relocate() before. */
 LIBTCCAPI int tcc_output_file(TCCState *s, const char *filename);
@@ -97,6 +129,12 @@ LIBTCCAPI int tcc_relocate(TCCState *s1, void *ptr);
    returns -1 if error. */
 #define TCC_RELOCATE_AUTO (void*)1
 
+/* same as tcc_relocate() with a memory address, but sections are only aligned
+   to cache lines and page permissions are left to the caller. Code is executed
+   at 'ptr + ptr_diff', e.g. from a second, executable mapping of the same memory.
+   With 'ptr' NULL returns the required memory size, -1 if error. */
+LIBTCCAPI int tcc_relocate_packed(TCCState *s1, void *ptr, unsigned long ptr_diff);
+
 /* return symbol value or NULL if not found */
 LIBTCCAPI void *tcc_get_symbol(TCCState *s, const char *name);
 
@@ -104,6 +142,20 @@ LIBTCCAPI void *tcc_get_symbol(TCCState *s, const char *name);
 LIBTCCAPI void tcc_list_symbols(TCCState *s, void *ctx,
     void (*symbol_cb)(void *ctx, const char *name, const void *val));
 
+/* return the approximate number of bytes held by the state */
+LIBTCCAPI unsigned long tcc_memory_usage(TCCState *s);
+
+/* counts of the compilation so far, see tcc_get_stats() */
+typedef struct TCCStats {
+    unsigned long tokens;      /* tokens read by the parser, without the
+                                  predefined macros and the prelude */
+    unsigned long symbols;     /* entries in the symbol table */
+    unsigned long relocations; /* entries in the relocation sections */
+} TCCStats;
+
+/* fill 'stats' with the counts of the state, also after tcc_relocate() */
+LIBTCCAPI void tcc_get_stats(TCCState *s, TCCStats *stats);
+
 #ifdef __cplusplus
 }
 #endif
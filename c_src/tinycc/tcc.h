@@ -363,19 +363,42 @@ extern long double strtold (const char *__nptr, char **__endptr);
 # define ONE_SOURCE 1
 #endif
 
+/* keep the compiler state (tccpp.c, tccgen.c, <target>-gen.c) in thread
+   local storage, so that several threads can compile at the same time */
+#ifndef CONFIG_TCC_THREADLOCAL
+# if (defined __GNUC__ || defined __clang__) && !defined __TINYC__ \
+     && !defined TCC_TARGET_C67
+#  define CONFIG_TCC_THREADLOCAL 1
+# else
+#  define CONFIG_TCC_THREADLOCAL 0
+# endif
+#endif
+
+#if CONFIG_TCC_THREADLOCAL
+# define ST_TLS __thread
+#else
+# define ST_TLS
+#endif
+
 /* support using libtcc from threads */
 #ifndef CONFIG_TCC_SEMLOCK
-# define CONFIG_TCC_SEMLOCK 1
+# if CONFIG_TCC_THREADLOCAL
+#  define CONFIG_TCC_SEMLOCK 0
+# else
+#  define CONFIG_TCC_SEMLOCK 1
+# endif
 #endif
 
 #if ONE_SOURCE
 #define ST_INLN static inline
 #define ST_FUNC static
-#define ST_DATA static
+#define ST_DATA static ST_TLS
+#define ST_RODATA static
 #else
 #define ST_INLN
 #define ST_FUNC
-#define ST_DATA extern
+#define ST_DATA extern ST_TLS
+#define ST_RODATA extern
 #endif
 
 #ifdef TCC_PROFILE /* profile all functions */
@@ -570,6 +593,12 @@ typedef struct Sym {
     struct Sym *prev_tok; /* previous symbol for this token */
 } Sym;
 
+/* section buffer kept by tcc_reset() */
+typedef struct SpareData {
+    unsigned char *data;
+    unsigned long size;
+} SpareData;
+
 /* section definition */
 typedef struct Section {
     unsigned long data_offset; /* current data offset */
@@ -779,6 +808,7 @@ struct TCCState {
     unsigned char do_bounds_check;
 #endif
     unsigned char test_coverage;  /* generate test coverage code */
+    unsigned char loop_budget; /* count loop iterations, see gen_loop_budget() */
 
 #ifdef TCC_TARGET_ARM
     enum float_abi float_abi; /* float ABI of the generated code*/
@@ -828,6 +858,14 @@ struct TCCState {
     CString cmdline_defs;
     /* -include options */
     CString cmdline_incl;
+    /* see tcc_set_prelude() */
+    char *prelude;
+    /* see tcc_set_resolve_func() */
+    void *resolve_opaque;
+    void *(*resolve_func)(void *opaque, const char *name);
+    /* section buffers kept by tcc_reset() */
+    SpareData *spare_data;
+    int nb_spare_data;
 
     /* error handling */
     void *error_opaque;
@@ -948,6 +986,7 @@ struct TCCState {
     const char *runtime_main;
     void **runtime_mem;
     int nb_runtime_mem;
+    unsigned char run_packed; /* see tcc_relocate_packed() */
 #endif
 
 #ifdef CONFIG_TCC_BACKTRACE
@@ -958,6 +997,7 @@ struct TCCState {
 
     /* benchmark info */
     int total_idents;
+    int total_tokens;
     int total_lines;
     int total_bytes;
     int total_output[4];
@@ -1368,6 +1408,25 @@ ST_DATA CString tokcstr; /* current parsed string, if any */
 ST_DATA int tok_ident;
 ST_DATA TokenSym **table_ident;
 
+/* addresses of the thread locals kept between compiles, see tcc_thread_data() */
+struct TCCThreadData {
+    TCCThreadData **self;
+    /* tccpp.c */
+    TokenSym ***table_ident;
+    TokenSym **hash_ident;
+    int *tok_ident;
+    struct TinyAlloc **toksym_alloc, **tokstr_alloc;
+    struct TinyAlloc **toksym_spare, **tokstr_spare;
+    struct PreludeSnapshot *pp_prelude;
+    Sym **define_stack;
+    /* tccgen.c */
+    void ***sym_pools;
+    int *nb_sym_pools;
+    Sym **sym_free_first;
+    Sym **global_stack;
+    struct PreludeSyms *prelude_syms;
+};
+
 #define TOK_FLAG_BOL   0x0001 /* beginning of line before */
 #define TOK_FLAG_BOF   0x0002 /* beginning of file before */
 #define TOK_FLAG_ENDIF 0x0004 /* a endif was found matching starting #ifdef */
@@ -1468,6 +1527,12 @@ ST_FUNC void tcc_debug_putfile(TCCState *s1, const char *filename);
 ST_FUNC void tccgen_init(TCCState *s1);
 ST_FUNC int tccgen_compile(TCCState *s1);
 ST_FUNC void tccgen_finish(TCCState *s1);
+ST_FUNC void tccgen_prelude_save(void);
+ST_FUNC void tccgen_prelude_free(void);
+ST_FUNC void tccgen_thread_data(TCCThreadData *td);
+ST_FUNC void tccgen_free_thread_data(TCCThreadData *td);
+ST_FUNC void tccpp_prelude_start(TCCState *s1);
+ST_FUNC Sym *tccpp_prelude_defines(void);
 ST_FUNC void check_vstack(void);
 
 ST_INLN int is_float(int t);
@@ -1559,6 +1624,8 @@ typedef struct {
 
 ST_FUNC void tccelf_new(TCCState *s);
 ST_FUNC void tccelf_delete(TCCState *s);
+ST_FUNC void tccelf_reset(TCCState *s);
+ST_FUNC void tccelf_free_spare(TCCState *s);
 ST_FUNC void tccelf_stab_new(TCCState *s);
 ST_FUNC void tccelf_begin_file(TCCState *s1);
 ST_FUNC void tccelf_end_file(TCCState *s1);
@@ -1639,8 +1706,8 @@ ST_FUNC void relocate_plt(TCCState *s1);
 ST_FUNC void relocate(TCCState *s1, ElfW_Rel *rel, int type, unsigned char *ptr, addr_t addr, addr_t val);
 
 /* ------------ xxx-gen.c ------------ */
-ST_DATA const char * const target_machine_defs;
-ST_DATA const int reg_classes[NB_REGS];
+ST_RODATA const char * const target_machine_defs;
+ST_RODATA const int reg_classes[NB_REGS];
 
 ST_FUNC void gsym_addr(int t, int a);
 ST_FUNC void gsym(int t);
@@ -1704,6 +1771,7 @@ ST_FUNC void gen_addr32(int r, Sym *sym, int c);
 ST_FUNC void gen_addrpc32(int r, Sym *sym, int c);
 ST_FUNC void gen_cvt_csti(int t);
 ST_FUNC void gen_increment_tcov (SValue *sv);
+ST_FUNC int gen_loop_budget_dec(int c, int t);
 #endif
 
 /* ------------ x86_64-gen.c ------------ */
@@ -1833,10 +1901,13 @@ ST_FUNC void gen_makedeps(TCCState *s, const char *target, const char *filename)
 
 /********************************************************/
 #undef ST_DATA
+#undef ST_RODATA
 #if ONE_SOURCE
-#define ST_DATA static
+#define ST_DATA static ST_TLS
+#define ST_RODATA static
 #else
-#define ST_DATA
+#define ST_DATA ST_TLS
+#define ST_RODATA
 #endif
 /********************************************************/
 
@@ -1858,6 +1929,7 @@ ST_FUNC void gen_makedeps(TCCState *s, const char *target, const char *filename)
 #define tcc_warning         TCC_SET_STATE(_tcc_warning)
 
 #define total_idents        TCC_STATE_VAR(total_idents)
+#define total_tokens        TCC_STATE_VAR(total_tokens)
 #define total_lines         TCC_STATE_VAR(total_lines)
 #define total_bytes         TCC_STATE_VAR(total_bytes)
 
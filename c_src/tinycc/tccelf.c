@@ -157,6 +157,91 @@ ST_FUNC void tccelf_delete(TCCState *s1)
     symtab_section = NULL; /* for tccrun.c:rt_printline() */
 }
 
+static void keep_section_data(TCCState *s1, Section *s)
+{
+    if (s->data) {
+        s1->spare_data[s1->nb_spare_data].data = s->data;
+        s1->spare_data[s1->nb_spare_data].size = s->data_allocated;
+        s1->nb_spare_data++;
+        s->data = NULL;
+    }
+}
+
+/* take the smallest kept buffer that holds 'size' bytes, see tccelf_reset() */
+static unsigned char *spare_section_data(TCCState *s1, unsigned long *size)
+{
+    SpareData *spare = s1->spare_data;
+    unsigned char *data;
+    int i, best = -1;
+
+    for (i = 0; i < s1->nb_spare_data; i++)
+        if (spare[i].size >= *size
+            && (best < 0 || spare[i].size < spare[best].size))
+            best = i;
+    if (best < 0)
+        return NULL;
+    *size = spare[best].size;
+    data = spare[best].data;
+    spare[best] = spare[--s1->nb_spare_data];
+    return data;
+}
+
+ST_FUNC void tccelf_free_spare(TCCState *s1)
+{
+    int i;
+
+    for (i = 0; i < s1->nb_spare_data; i++)
+        tcc_free(s1->spare_data[i].data);
+    tcc_free(s1->spare_data);
+    s1->spare_data = NULL;
+    s1->nb_spare_data = 0;
+}
+
+/* free all sections and create the standard ones again. The section buffers
+   are kept for the next sections. */
+ST_FUNC void tccelf_reset(TCCState *s1)
+{
+    int i;
+
+    tccelf_free_spare(s1);
+    s1->spare_data = tcc_malloc((s1->nb_sections + s1->nb_priv_sections)
+                                * sizeof *s1->spare_data);
+    for (i = 1; i < s1->nb_sections; i++)
+        keep_section_data(s1, s1->sections[i]);
+    for (i = 0; i < s1->nb_priv_sections; i++)
+        keep_section_data(s1, s1->priv_sections[i]);
+    tccelf_delete(s1);
+
+#ifndef ELF_OBJ_ONLY
+    sym_versions = NULL;
+    nb_sym_versions = 0;
+    sym_to_version = NULL;
+    nb_sym_to_version = 0;
+    dt_verneednum = 0;
+    versym_section = verneed_section = NULL;
+#endif
+    s1->sym_attrs = NULL;
+    s1->nb_sym_attrs = 0;
+    s1->got = s1->plt = s1->dynsym = NULL;
+    cur_text_section = NULL;
+#ifdef CONFIG_TCC_BCHECK
+    bounds_section = lbounds_section = NULL;
+#endif
+    tcov_section = stab_section = NULL;
+#if defined TCC_TARGET_PE && defined TCC_TARGET_X86_64
+    s1->uw_pdata = NULL;
+#endif
+    s1->new_undef_sym = 0;
+
+    tccelf_new(s1);
+#ifdef CONFIG_TCC_BCHECK
+    if (s1->do_bounds_check)
+        tccelf_bounds_new(s1);
+#endif
+    if (s1->do_debug)
+        tccelf_stab_new(s1);
+}
+
 /* save section data state */
 ST_FUNC void tccelf_begin_file(TCCState *s1)
 {
@@ -293,11 +378,16 @@ ST_FUNC void section_realloc(Section *sec, unsigned long new_size)
     unsigned char *data;
 
     size = sec->data_allocated;
-    if (size == 0)
+    if (size == 0) {
+        size = new_size;
+        if (sec->s1->nb_spare_data && (data = spare_section_data(sec->s1, &size)))
+            goto done;
         size = 1;
+    }
     while (size < new_size)
         size = size * 2;
     data = tcc_realloc(sec->data, size);
+done:
     memset(data + sec->data_allocated, 0, size - sec->data_allocated);
     sec->data = data;
     sec->data_allocated = size;
@@ -560,6 +650,67 @@ LIBTCCAPI void tcc_list_symbols(TCCState *s, void *ctx,
     list_elf_symbols(s, ctx, symbol_cb);
 }
 
+/* make the defined global symbols local, unless 'keep_cb' wants them kept */
+LIBTCCAPI void tcc_localize_symbols(TCCState *s, void *ctx,
+    int (*keep_cb)(void *ctx, const char *name))
+{
+    ElfW(Sym) *sym;
+    Section *symtab;
+    int sym_index, end_sym, localized;
+    const char *name;
+
+    symtab = s->symtab;
+    end_sym = symtab->data_offset / sizeof (ElfSym);
+    localized = 0;
+    for (sym_index = 1; sym_index < end_sym; ++sym_index) {
+        sym = &((ElfW(Sym) *)symtab->data)[sym_index];
+        if (sym->st_shndx == SHN_UNDEF
+            || ELFW(ST_BIND)(sym->st_info) == STB_LOCAL)
+            continue;
+        name = (char *) symtab->link->data + sym->st_name;
+        if (keep_cb(ctx, name))
+            continue;
+        sym->st_info = ELFW(ST_INFO)(STB_LOCAL, ELFW(ST_TYPE)(sym->st_info));
+        localized = 1;
+    }
+    /* local symbols are not hashed, so they are no longer found by name */
+    if (localized)
+        rebuild_hash(symtab, 0);
+}
+
+/* return the memory held by the state, including the sections and the
+   code relocated with TCC_RELOCATE_AUTO */
+LIBTCCAPI unsigned long tcc_memory_usage(TCCState *s)
+{
+    unsigned long size = sizeof (TCCState);
+    int i;
+
+    for (i = 1; i < s->nb_sections; i++)
+        size += sizeof (Section) + s->sections[i]->data_allocated;
+    for (i = 0; i < s->nb_priv_sections; i++)
+        size += sizeof (Section) + s->priv_sections[i]->data_allocated;
+#ifdef TCC_IS_NATIVE
+    for (i = 0; i < s->nb_runtime_mem; i += 2)
+        size += (unsigned)(addr_t)s->runtime_mem[i];
+#endif
+    return size;
+}
+
+LIBTCCAPI void tcc_get_stats(TCCState *s1, TCCStats *stats)
+{
+    Section *sec;
+    int i;
+
+    stats->tokens = total_tokens;
+    stats->symbols = symtab_section->data_offset / sizeof (ElfW(Sym));
+    stats->relocations = 0;
+    for (i = 1; i < s1->nb_sections; i++) {
+        sec = s1->sections[i];
+        if (sec->sh_type == SHT_RELX)
+            stats->relocations += sec->data_offset / sizeof (ElfW_Rel);
+    }
+}
+
 #ifndef ELF_OBJ_ONLY
 static void
 version_add (TCCState *s1)
@@ -909,6 +1060,16 @@ ST_FUNC void relocate_syms(TCCState *s1, Section *symtab, int do_resolve)
         sh_num = sym->st_shndx;
         if (sh_num == SHN_UNDEF) {
             name = (char *) s1->symtab->link->data + sym->st_name;
+#if defined TCC_IS_NATIVE && !defined TCC_TARGET_PE
+            /* symbols provided by the host, see tcc_set_resolve_func() */
+            if (s1->resolve_func && s1->output_type == TCC_OUTPUT_MEMORY) {
+                void *addr = s1->resolve_func(s1->resolve_opaque, &name[s1->leading_underscore]);
+                if (addr) {
+                    sym->st_value = (addr_t) addr;
+                    goto found;
+                }
+            }
+#endif
             /* Use ld.so to resolve symbol for us (for tcc -run) */
             if (do_resolve) {
 #if defined TCC_IS_NATIVE && !defined TCC_TARGET_PE
@@ -37,19 +37,29 @@ ST_DATA Sym *define_stack;
 ST_DATA Sym *global_label_stack;
 ST_DATA Sym *local_label_stack;
 
-static Sym *sym_free_first;
-static void **sym_pools;
-static int nb_sym_pools;
-
-static Sym *all_cleanups, *pending_gotos;
-static int local_scope;
-static int in_sizeof;
-static int in_generic;
-static int section_sym;
+static ST_TLS Sym *sym_free_first;
+static ST_TLS void **sym_pools;
+static ST_TLS int nb_sym_pools;
+
+/* global symbols of the prelude snapshot, see tcc_set_prelude(). Compiles
+   can complete their types or assign ELF symbols, so their original content
+   is restored after each compile. */
+static ST_TLS struct PreludeSyms {
+    Sym *global_stack;
+    Sym *saved;
+    int nb_saved;
+    int anon_sym;
+} prelude_syms;
+
+static ST_TLS Sym *all_cleanups, *pending_gotos;
+static ST_TLS int local_scope;
+static ST_TLS int in_sizeof;
+static ST_TLS int in_generic;
+static ST_TLS int section_sym;
 ST_DATA char debug_modes;
 
 ST_DATA SValue *vtop;
-static SValue _vstack[1 + VSTACK_SIZE];
+static ST_TLS SValue _vstack[1 + VSTACK_SIZE];
 #define vstack (_vstack + 1)
 
 ST_DATA int const_wanted; /* true if constant wanted */
@@ -81,10 +91,11 @@ ST_DATA int global_expr;  /* true if compound literals must be allocated globall
 ST_DATA CType func_vt; /* current function return type (used by return instruction) */
 ST_DATA int func_var; /* true if current function is variadic (used by return instruction) */
 ST_DATA int func_vc;
-static int last_line_num, new_file, func_ind; /* debug info control */
+static ST_TLS int last_line_num, new_file, func_ind; /* debug info control */
+static ST_TLS int loop_budget_loc; /* stack slot of the loop budget counter */
 ST_DATA const char *funcname;
 ST_DATA CType int_type, func_old_type, char_type, char_pointer_type;
-static CString initstr;
+static ST_TLS CString initstr;
 
 #if PTR_SIZE == 4
 #define VT_SIZE_T (VT_INT | VT_UNSIGNED)
@@ -116,9 +127,9 @@ ST_DATA struct temp_local_variable {
 	short size;
 	short align;
 } arr_temp_local_vars[MAX_TEMP_LOCAL_VARIABLE_NUMBER];
-short nb_temp_local_vars;
+ST_TLS short nb_temp_local_vars;
 
-static struct scope {
+static ST_TLS struct scope {
     struct scope *prev;
     struct { int loc, locorig, num; } vla;
     struct { Sym *s; int n; } cl;
@@ -183,16 +194,16 @@ static const struct {
     {   VT_VOID, "void:t27=27" },
 };
 
-static int debug_next_type;
+static ST_TLS int debug_next_type;
 
-static struct debug_hash {
+static ST_TLS struct debug_hash {
     int debug_type;
     Sym *type;
 } *debug_hash;
 
-static int n_debug_hash;
+static ST_TLS int n_debug_hash;
 
-static struct debug_info {
+static ST_TLS struct debug_info {
     int start;
     int end;
     int n_sym;
@@ -206,7 +217,7 @@ static struct debug_info {
     struct debug_info *child, *next, *last, *parent;
 } *debug_info, *debug_info_root;
 
-static struct {
+static ST_TLS struct {
     unsigned long offset;
     unsigned long last_file_name;
     unsigned long last_func_name;
@@ -985,6 +996,8 @@ ST_FUNC int tccgen_compile(TCCState *s1)
     const_wanted = 0;
     nocode_wanted = 0x80000000;
     local_scope = 0;
+    if (prelude_syms.global_stack)
+        anon_sym = prelude_syms.anon_sym;
     debug_modes = s1->do_debug | s1->test_coverage << 1;
 
     tcc_debug_start(s1);
@@ -996,6 +1009,7 @@ ST_FUNC int tccgen_compile(TCCState *s1)
     printf("%s: **** new file\n", file->filename);
 #endif
     parse_flags = PARSE_FLAG_PREPROCESS | PARSE_FLAG_TOK_NUM | PARSE_FLAG_TOK_STR;
+    tccpp_prelude_start(s1);
     next();
     decl(VT_CONST);
     gen_inline_functions(s1);
@@ -1008,8 +1022,20 @@ ST_FUNC int tccgen_compile(TCCState *s1)
 
 ST_FUNC void tccgen_finish(TCCState *s1)
 {
+    Sym *s;
+    int i;
+
     cstr_free(&initstr);
     free_inline_functions(s1);
+    if (prelude_syms.global_stack) {
+        /* pop down to the prelude and keep the sym_pools */
+        sym_pop(&local_stack, NULL, 0);
+        sym_pop(&global_stack, prelude_syms.global_stack, 0);
+        for (s = global_stack, i = 0; s; s = s->prev, i++)
+            *s = prelude_syms.saved[i];
+        free_defines(tccpp_prelude_defines());
+        return;
+    }
     sym_pop(&global_stack, NULL, 0);
     sym_pop(&local_stack, NULL, 0);
     /* free preprocessor macros */
@@ -1019,6 +1045,48 @@ ST_FUNC void tccgen_finish(TCCState *s1)
     sym_free_first = NULL;
 }
 
+/* take the snapshot at the end of the prelude */
+ST_FUNC void tccgen_prelude_save(void)
+{
+    Sym *s;
+    int i;
+
+    for (s = global_stack, i = 0; s; s = s->prev)
+        i++;
+    prelude_syms.saved = tcc_malloc(i * sizeof (Sym));
+    prelude_syms.nb_saved = i;
+    for (s = global_stack, i = 0; s; s = s->prev, i++)
+        prelude_syms.saved[i] = *s;
+    prelude_syms.global_stack = global_stack;
+    prelude_syms.anon_sym = anon_sym;
+}
+
+/* drop the snapshot, the next tccgen_finish() frees everything */
+ST_FUNC void tccgen_prelude_free(void)
+{
+    tcc_free(prelude_syms.saved);
+    memset(&prelude_syms, 0, sizeof prelude_syms);
+}
+
+ST_FUNC void tccgen_thread_data(TCCThreadData *td)
+{
+    td->sym_pools = &sym_pools;
+    td->nb_sym_pools = &nb_sym_pools;
+    td->sym_free_first = &sym_free_first;
+    td->global_stack = &global_stack;
+    td->prelude_syms = &prelude_syms;
+}
+
+/* the symbols of the snapshot all live in the sym_pools */
+ST_FUNC void tccgen_free_thread_data(TCCThreadData *td)
+{
+    dynarray_reset(td->sym_pools, td->nb_sym_pools);
+    *td->sym_free_first = NULL;
+    *td->global_stack = NULL;
+    tcc_free(td->prelude_syms->saved);
+    memset(td->prelude_syms, 0, sizeof *td->prelude_syms);
+}
+
 /* ------------------------------------------------------------------------- */
 ST_FUNC ElfSym *elfsym(Sym *s)
 {
@@ -6792,7 +6860,7 @@ static int precedence(int tok)
 	    return 0;
     }
 }
-static unsigned char prec[256];
+static ST_TLS unsigned char prec[256];
 static void init_prec(void)
 {
     int i;
@@ -7369,6 +7437,52 @@ void leave_scope(struct scope *o)
     vla_leave(o);
 }
 
+/* ------------------------------------------------------------------------- */
+/* loop budget (-floop-budget): every function keeps a counter on its stack
+   that is decremented at each loop head. When it drops below zero the
+   runtime hook __loop_budget_exhausted() is called, which returns the
+   next budget. This allows an embedding runtime to check the elapsed
+   time of long running loops without having to do so on each iteration */
+
+#define LOOP_BUDGET_INIT 1024
+
+static void loop_budget_init(void)
+{
+    if (!tcc_state->loop_budget)
+        return;
+    loc = (loc - 4) & -4;
+    loop_budget_loc = loc;
+    vset(&int_type, VT_LOCAL | VT_LVAL, loop_budget_loc);
+    vpushi(LOOP_BUDGET_INIT);
+    vstore();
+    vpop();
+}
+
+/* if (--budget < 0) budget = __loop_budget_exhausted(); */
+static void gen_loop_budget(void)
+{
+    int a;
+    if (!tcc_state->loop_budget || nocode_wanted)
+        return;
+#if defined TCC_TARGET_I386 || defined TCC_TARGET_X86_64
+    a = gen_loop_budget_dec(loop_budget_loc, 0);
+#else
+    vset(&int_type, VT_LOCAL | VT_LVAL, loop_budget_loc);
+    inc(0, TOK_DEC);
+    vpushi(0);
+    gen_op(TOK_LT);
+    a = gvtst(1, 0);
+#endif
+    vset(&int_type, VT_LOCAL | VT_LVAL, loop_budget_loc);
+    vpush_helper_func(TOK___loop_budget_exhausted);
+    gfunc_call(0);
+    vpushi(0);
+    PUT_R_RET(vtop, VT_INT);
+    vstore();
+    vpop();
+    gsym(a);
+}
+
 /* ------------------------------------------------------------------------- */
 /* call block from 'for do while' loops */
 
@@ -7430,6 +7544,7 @@ again:
 
     } else if (t == TOK_WHILE) {
         d = gind();
+        gen_loop_budget();
         skip('(');
         gexpr();
         skip(')');
@@ -7530,6 +7645,7 @@ again:
         skip(';');
         a = b = 0;
         c = d = gind();
+        gen_loop_budget();
         if (tok != ';') {
             gexpr();
             a = gvtst(1, 0);
@@ -7553,6 +7669,7 @@ again:
     } else if (t == TOK_DO) {
         a = b = 0;
         d = gind();
+        gen_loop_budget();
         lblock(&a, &b);
         gsym(b);
         skip(TOK_WHILE);
@@ -8695,6 +8812,7 @@ static void gen_function(Sym *sym)
     local_scope = 0;
     rsym = 0;
     clear_temp_local_var_list();
+    loop_budget_init();
     block(0);
     gsym(rsym);
     nocode_wanted = 0;
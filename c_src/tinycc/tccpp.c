@@ -39,22 +39,55 @@ ST_DATA TokenSym **table_ident;
 
 /* ------------------------------------------------------------------------- */
 
-static TokenSym *hash_ident[TOK_HASH_SIZE];
-static char token_buf[STRING_MAX_SIZE + 1];
-static CString cstr_buf;
-static CString macro_equal_buf;
-static TokenString tokstr_buf;
-static unsigned char isidnum_table[256 - CH_EOF];
-static int pp_debug_tok, pp_debug_symv;
-static int pp_once;
-static int pp_expr;
-static int pp_counter;
+static ST_TLS TokenSym *hash_ident[TOK_HASH_SIZE];
+static ST_TLS char token_buf[STRING_MAX_SIZE + 1];
+static ST_TLS CString cstr_buf;
+static ST_TLS CString macro_equal_buf;
+static ST_TLS TokenString tokstr_buf;
+static ST_TLS unsigned char isidnum_table[256 - CH_EOF];
+static ST_TLS int pp_debug_tok, pp_debug_symv;
+static ST_TLS int pp_once;
+static ST_TLS int pp_expr;
+static ST_TLS int pp_counter;
 static void tok_print(const char *msg, const int *str);
 
-static struct TinyAlloc *toksym_alloc;
-static struct TinyAlloc *tokstr_alloc;
-
-static TokenString *macro_stack;
+static ST_TLS struct TinyAlloc *toksym_alloc;
+static ST_TLS struct TinyAlloc *tokstr_alloc;
+
+static ST_TLS TokenString *macro_stack;
+
+/* empty allocators of the last compile on this thread, reused by the next */
+static ST_TLS struct TinyAlloc *toksym_spare, *tokstr_spare;
+
+/* tokens of the predefs and the prelude are not counted in total_tokens,
+   so compiles that resume a snapshot report the same numbers */
+static ST_TLS int pp_cmdline, pp_cmdline_tokens;
+
+/* prelude snapshot, see tcc_set_prelude(). The tokens, macros and global
+   symbols left behind by the predefined macros and the prelude are kept
+   between compiles. Compiles with the same prelude start from there and
+   restore this state again when done. */
+typedef struct PreludeTok {
+    TokenSym *hash_next;
+    Sym *sym_define, *sym_label, *sym_struct, *sym_identifier;
+} PreludeTok;
+
+static ST_TLS struct PreludeSnapshot {
+    char *key; /* predefs and prelude text */
+    int key_len;
+    int dollars;
+    int recording;
+    unsigned long elf_offsets[5];
+    int tok_ident; /* non zero with a snapshot */
+    Sym *define_stack;
+    PreludeTok *toks;
+    struct TinyAlloc *toksym_alloc, *tokstr_alloc;
+} pp_prelude;
+
+static unsigned long *prelude_elf_offsets(TCCState *s1, unsigned long *offsets);
+static void prelude_save(TCCState *s1);
+static void prelude_free(TCCState *s1);
+static void tccpp_new_buffers(TCCState *s);
 
 static const char tcc_keywords[] = 
 #define DEF(id, str) str "\0"
@@ -216,6 +249,16 @@ tail_call:
     goto tail_call;
 }
 
+/* keep an allocator with nothing allocated for reuse, delete it otherwise */
+static void tal_recycle(TinyAlloc **spare, TinyAlloc *al)
+{
+    if (al && !al->next && !al->nb_allocs && !*spare) {
+        al->p = al->buffer;
+        *spare = al;
+    } else
+        tal_delete(al);
+}
+
 static void tal_free_impl(TinyAlloc *al, void *p TAL_DEBUG_PARAMS)
 {
     if (!p)
@@ -2711,6 +2754,13 @@ static inline void next_nomacro1(void)
                 /* pop include stack */
                 tcc_close();
                 s1->include_stack_ptr--;
+                if (pp_cmdline && s1->include_stack_ptr == s1->include_stack) {
+                    pp_cmdline = 0;
+                    /* next() already counted the token it is reading now */
+                    total_tokens = pp_cmdline_tokens + 1;
+                    if (pp_prelude.recording)
+                        prelude_save(s1);
+                }
                 p = file->buf_ptr;
                 if (p == file->buffer)
                     tok_flags = TOK_FLAG_BOF|TOK_FLAG_BOL;
@@ -3613,6 +3663,7 @@ static void next_nomacro(void)
 ST_FUNC void next(void)
 {
     int t;
+    total_tokens++;
  redo:
     next_nomacro();
     t = tok;
@@ -3753,9 +3804,32 @@ static void tcc_predefs(TCCState *s1, CString *cs, int is_asm)
 ST_FUNC void preprocess_start(TCCState *s1, int filetype)
 {
     int is_asm = !!(filetype & (AFF_TYPE_ASM|AFF_TYPE_ASMPP));
+    int prelude = s1->prelude && !is_asm, resumed = 0;
     CString cstr;
 
-    tccpp_new(s1);
+    cstr_new(&cstr);
+    if (!(filetype & AFF_TYPE_ASM)) {
+        tcc_predefs(s1, &cstr, is_asm);
+        if (s1->cmdline_defs.size)
+          cstr_cat(&cstr, s1->cmdline_defs.data, s1->cmdline_defs.size);
+        if (s1->cmdline_incl.size)
+          cstr_cat(&cstr, s1->cmdline_incl.data, s1->cmdline_incl.size);
+        if (prelude)
+          cstr_cat(&cstr, s1->prelude, -1);
+    }
+
+    if (pp_prelude.tok_ident) {
+        resumed = prelude
+            && pp_prelude.key_len == cstr.size
+            && pp_prelude.dollars == s1->dollars_in_identifiers
+            && !memcmp(pp_prelude.key, cstr.data, cstr.size);
+        if (!resumed)
+            prelude_free(s1);
+    }
+    if (resumed)
+        tccpp_new_buffers(s1);
+    else
+        tccpp_new(s1);
 
     s1->include_stack_ptr = s1->include_stack;
     s1->ifdef_stack_ptr = s1->ifdef_stack;
@@ -3766,23 +3840,28 @@ ST_FUNC void preprocess_start(TCCState *s1, int filetype)
     pp_once++;
     s1->pack_stack[0] = 0;
     s1->pack_stack_ptr = s1->pack_stack;
+    pp_cmdline = 0;
 
     set_idnum('$', !is_asm && s1->dollars_in_identifiers ? IS_ID : 0);
     set_idnum('.', is_asm ? IS_ID : 0);
 
-    if (!(filetype & AFF_TYPE_ASM)) {
-        cstr_new(&cstr);
-        tcc_predefs(s1, &cstr, is_asm);
-        if (s1->cmdline_defs.size)
-          cstr_cat(&cstr, s1->cmdline_defs.data, s1->cmdline_defs.size);
-        if (s1->cmdline_incl.size)
-          cstr_cat(&cstr, s1->cmdline_incl.data, s1->cmdline_incl.size);
+    if (!(filetype & AFF_TYPE_ASM) && !resumed) {
+        if (prelude) {
+            /* take a snapshot when leaving the <command line> buffer */
+            pp_prelude.key = tcc_malloc(cstr.size);
+            memcpy(pp_prelude.key, cstr.data, cstr.size);
+            pp_prelude.key_len = cstr.size;
+            pp_prelude.dollars = s1->dollars_in_identifiers;
+            pp_prelude.recording = 1;
+        }
         //printf("%s\n", (char*)cstr.data);
+        pp_cmdline = 1;
+        pp_cmdline_tokens = total_tokens;
         *s1->include_stack_ptr++ = file;
         tcc_open_bf(s1, "<command line>", cstr.size);
         memcpy(file->buffer, cstr.data, cstr.size);
-        cstr_free(&cstr);
     }
+    cstr_free(&cstr);
 
     parse_flags = is_asm ? PARSE_FLAG_ASM_FILE : 0;
     tok_flags = TOK_FLAG_BOL | TOK_FLAG_BOF;
@@ -3799,10 +3878,9 @@ ST_FUNC void preprocess_end(TCCState *s1)
     tccpp_delete(s1);
 }
 
-ST_FUNC void tccpp_new(TCCState *s)
+static void tccpp_new_buffers(TCCState *s)
 {
-    int i, c;
-    const char *p, *r;
+    int i;
 
     /* init isid table */
     for(i = CH_EOF; i<128; i++)
@@ -3816,16 +3894,30 @@ ST_FUNC void tccpp_new(TCCState *s)
         set_idnum(i, IS_ID);
 
     /* init allocators */
-    tal_new(&toksym_alloc, TOKSYM_TAL_LIMIT, TOKSYM_TAL_SIZE);
-    tal_new(&tokstr_alloc, TOKSTR_TAL_LIMIT, TOKSTR_TAL_SIZE);
+    if (toksym_spare)
+        toksym_alloc = toksym_spare, toksym_spare = NULL;
+    else
+        tal_new(&toksym_alloc, TOKSYM_TAL_LIMIT, TOKSYM_TAL_SIZE);
+    if (tokstr_spare)
+        tokstr_alloc = tokstr_spare, tokstr_spare = NULL;
+    else
+        tal_new(&tokstr_alloc, TOKSTR_TAL_LIMIT, TOKSTR_TAL_SIZE);
 
-    memset(hash_ident, 0, TOK_HASH_SIZE * sizeof(TokenSym *));
     memset(s->cached_includes_hash, 0, sizeof s->cached_includes_hash);
 
     cstr_new(&cstr_buf);
     cstr_realloc(&cstr_buf, STRING_MAX_SIZE);
     tok_str_new(&tokstr_buf);
     tok_str_realloc(&tokstr_buf, TOKSTR_MAX_SIZE);
+}
+
+ST_FUNC void tccpp_new(TCCState *s)
+{
+    const char *p, *r;
+    int c;
+
+    tccpp_new_buffers(s);
+    memset(hash_ident, 0, TOK_HASH_SIZE * sizeof(TokenSym *));
 
     tok_ident = TOK_IDENT;
     p = tcc_keywords;
@@ -3849,9 +3941,21 @@ ST_FUNC void tccpp_new(TCCState *s)
     define_push(TOK___COUNTER__, MACRO_OBJ, NULL, NULL);
 }
 
+static unsigned tok_hash(const char *str, int len)
+{
+    unsigned h = TOK_HASH_INIT;
+    int i;
+
+    for (i = 0; i < len; i++)
+        h = TOK_HASH_FUNC(h, ((unsigned char *)str)[i]);
+    return h & (TOK_HASH_SIZE - 1);
+}
+
 ST_FUNC void tccpp_delete(TCCState *s)
 {
-    int i, n;
+    int i, n, m;
+    TokenSym *ts;
+    PreludeTok *pt;
 
     dynarray_reset(&s->cached_includes, &s->nb_cached_includes);
 
@@ -3859,22 +3963,176 @@ ST_FUNC void tccpp_delete(TCCState *s)
     n = tok_ident - TOK_IDENT;
     if (n > total_idents)
         total_idents = n;
-    for(i = 0; i < n; i++)
-        tal_free(toksym_alloc, table_ident[i]);
-    tcc_free(table_ident);
-    table_ident = NULL;
+    m = pp_prelude.tok_ident ? pp_prelude.tok_ident - TOK_IDENT : 0;
+    for(i = n; i-- > m;) {
+        ts = table_ident[i];
+        if (m) {
+            /* new tokens are appended to the hash chains */
+            unsigned h = tok_hash(ts->str, ts->len);
+            if (hash_ident[h] == ts)
+                hash_ident[h] = NULL;
+        }
+        tal_free(toksym_alloc, ts);
+    }
+
+    if (m) {
+        /* restore the snapshot of the prelude */
+        tok_ident = pp_prelude.tok_ident;
+        for (i = 0; i < m; i++) {
+            ts = table_ident[i], pt = &pp_prelude.toks[i];
+            ts->hash_next = pt->hash_next;
+            ts->sym_define = pt->sym_define;
+            ts->sym_label = pt->sym_label;
+            ts->sym_struct = pt->sym_struct;
+            ts->sym_identifier = pt->sym_identifier;
+        }
+    } else {
+        tcc_free(table_ident);
+        table_ident = NULL;
+        tcc_free(pp_prelude.key);
+        pp_prelude.key = NULL;
+        pp_prelude.recording = 0;
+    }
 
     /* free static buffers */
     cstr_free(&tokcstr);
     cstr_free(&cstr_buf);
     cstr_free(&macro_equal_buf);
     tok_str_free_str(tokstr_buf.str);
+    tokstr_buf.str = NULL;
+
+    /* free allocators, except for the ones of the snapshot */
+    if (toksym_alloc != pp_prelude.toksym_alloc) {
+        tal_recycle(&toksym_spare, toksym_alloc);
+        tal_recycle(&tokstr_spare, tokstr_alloc);
+    }
+    toksym_alloc = pp_prelude.toksym_alloc;
+    tokstr_alloc = pp_prelude.tokstr_alloc;
+}
+
+static unsigned long *prelude_elf_offsets(TCCState *s1, unsigned long *offsets)
+{
+    offsets[0] = symtab_section->data_offset;
+    offsets[1] = text_section->data_offset;
+    offsets[2] = data_section->data_offset;
+    offsets[3] = bss_section->data_offset;
+    offsets[4] = rodata_section->data_offset;
+    return offsets;
+}
+
+/* called at the end of the predefs and prelude */
+static void prelude_save(TCCState *s1)
+{
+    unsigned long offsets[5];
+    int i, n;
+
+    pp_prelude.recording = 0;
+    /* no snapshot when the prelude defined functions or data */
+    if (s1->nb_inline_fns || memcmp(pp_prelude.elf_offsets,
+            prelude_elf_offsets(s1, offsets), sizeof offsets)) {
+        tcc_free(pp_prelude.key);
+        pp_prelude.key = NULL;
+        return;
+    }
+
+    n = tok_ident - TOK_IDENT;
+    pp_prelude.toks = tcc_malloc(n * sizeof (PreludeTok));
+    for (i = 0; i < n; i++) {
+        TokenSym *ts = table_ident[i];
+        PreludeTok *pt = &pp_prelude.toks[i];
+        pt->hash_next = ts->hash_next;
+        pt->sym_define = ts->sym_define;
+        pt->sym_label = ts->sym_label;
+        pt->sym_struct = ts->sym_struct;
+        pt->sym_identifier = ts->sym_identifier;
+    }
+    pp_prelude.tok_ident = tok_ident;
+    pp_prelude.define_stack = define_stack;
+    pp_prelude.toksym_alloc = toksym_alloc;
+    pp_prelude.tokstr_alloc = tokstr_alloc;
+    tccgen_prelude_save();
+}
+
+/* free the snapshot together with all its tokens, macros and symbols */
+static void prelude_free(TCCState *s1)
+{
+    tccgen_prelude_free();
+    tccgen_finish(s1);
+    tcc_free(pp_prelude.toks);
+    tcc_free(pp_prelude.key);
+    memset(&pp_prelude, 0, sizeof pp_prelude);
+    tccpp_delete(s1);
+}
+
+/* called by tccgen_compile() before the first token */
+ST_FUNC void tccpp_prelude_start(TCCState *s1)
+{
+    if (pp_prelude.recording)
+        prelude_elf_offsets(s1, pp_prelude.elf_offsets);
+}
+
+ST_FUNC Sym *tccpp_prelude_defines(void)
+{
+    return pp_prelude.define_stack;
+}
+
+static ST_TLS TCCThreadData *thread_data;
 
-    /* free allocators */
-    tal_delete(toksym_alloc);
-    toksym_alloc = NULL;
-    tal_delete(tokstr_alloc);
-    tokstr_alloc = NULL;
+LIBTCCAPI TCCThreadData *tcc_thread_data(void)
+{
+    TCCThreadData *td = thread_data;
+
+    if (!td) {
+        td = tcc_mallocz(sizeof *td);
+        td->self = &thread_data;
+        td->table_ident = &table_ident;
+        td->hash_ident = hash_ident;
+        td->tok_ident = &tok_ident;
+        td->toksym_alloc = &toksym_alloc;
+        td->tokstr_alloc = &tokstr_alloc;
+        td->toksym_spare = &toksym_spare;
+        td->tokstr_spare = &tokstr_spare;
+        td->pp_prelude = &pp_prelude;
+        td->define_stack = &define_stack;
+        tccgen_thread_data(td);
+        thread_data = td;
+    }
+    return td;
+}
+
+/* like prelude_free() without a TCCState, going through the addresses
+   as this may run on another thread */
+LIBTCCAPI void tcc_free_thread_data(TCCThreadData *td)
+{
+    struct PreludeSnapshot *pp = td->pp_prelude;
+    TokenSym **table = *td->table_ident;
+    Sym *s;
+    int i, m;
+
+    m = pp->tok_ident ? pp->tok_ident - TOK_IDENT : 0;
+    for (s = *td->define_stack; s; s = s->prev)
+        tal_free(*td->tokstr_alloc, s->d);
+    for (i = 0; i < m; i++)
+        tal_free(*td->toksym_alloc, table[i]);
+    tcc_free(table);
+    *td->table_ident = NULL;
+    *td->tok_ident = 0;
+    *td->define_stack = NULL;
+    memset(td->hash_ident, 0, TOK_HASH_SIZE * sizeof (TokenSym *));
+    tccgen_free_thread_data(td);
+
+    tal_delete(*td->toksym_alloc);
+    tal_delete(*td->tokstr_alloc);
+    tal_delete(*td->toksym_spare);
+    tal_delete(*td->tokstr_spare);
+    *td->toksym_alloc = *td->tokstr_alloc = NULL;
+    *td->toksym_spare = *td->tokstr_spare = NULL;
+
+    tcc_free(pp->toks);
+    tcc_free(pp->key);
+    memset(pp, 0, sizeof *pp);
+    *td->self = NULL;
+    tcc_free(td);
 }
 
 /* ------------------------------------------------------------------------- */
@@ -107,6 +107,12 @@ LIBTCCAPI int tcc_relocate(TCCState *s1, void *ptr)
     return 0;
 }
 
+LIBTCCAPI int tcc_relocate_packed(TCCState *s1, void *ptr, unsigned long ptr_diff)
+{
+    s1->run_packed = 1;
+    return tcc_relocate_ex(s1, ptr, ptr ? ptr_diff : 0);
+}
+
 ST_FUNC void tcc_run_free(TCCState *s1)
 {
     int i;
@@ -233,7 +239,7 @@ static int tcc_relocate_ex(TCCState *s1, void *ptr, addr_t ptr_diff)
 {
     Section *s;
     unsigned offset, length, align, max_align, i, k, f;
-    unsigned n, copy;
+    unsigned n, copy, page_align;
     addr_t mem, addr;
 
     if (NULL == ptr) {
@@ -254,6 +260,8 @@ static int tcc_relocate_ex(TCCState *s1, void *ptr, addr_t ptr_diff)
     offset += sizeof (void*); /* space for function_table pointer */
 #endif
     copy = 0;
+    /* packed code shares its pages, keep code and data in separate cache lines */
+    page_align = s1->run_packed ? 64 : PAGE_ALIGN;
 redo:
     for (k = 0; k < 3; ++k) { /* 0:rx, 1:ro, 2:rw sections */
         n = 0; addr = 0;
@@ -289,8 +297,8 @@ redo:
                 continue;
             }
             align = s->sh_addralign - 1;
-            if (++n == 1 && align < (PAGE_ALIGN - 1))
-                align = (PAGE_ALIGN - 1);
+            if (++n == 1 && align < (page_align - 1))
+                align = (page_align - 1);
             if (max_align < align)
                 max_align = align;
             addr = k ? mem : mem + ptr_diff;
@@ -303,6 +311,15 @@ redo:
                     k, s->name, (void*)s->sh_addr, length, align + 1);
 #endif
         }
+        if (copy && s1->run_packed) {
+# if (TCC_TARGET_ARM && !TARGETOS_BSD) || TCC_TARGET_ARM64
+            if (k == 0 && n) {
+                void __clear_cache(void *beginning, void *end);
+                __clear_cache((void*)addr, (char *)addr + n);
+            }
+# endif
+            continue;
+        }
         if (copy) { /* set permissions */
             if (k == 0 && ptr_diff)
                 continue; /* not with HAVE_SELINUX */
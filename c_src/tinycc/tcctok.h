@@ -322,6 +322,9 @@
      DEF(TOK___getf2, "__getf2")
 #endif
 
+/* loop budget symbols */
+     DEF(TOK___loop_budget_exhausted, "__loop_budget_exhausted")
+
 /* bound checking symbols */
 #ifdef CONFIG_TCC_BCHECK
      DEF(TOK___bound_ptr_add, "__bound_ptr_add")
@@ -112,12 +112,12 @@ enum {
 #include "tcc.h"
 #include <assert.h>
 
-ST_DATA const char * const target_machine_defs =
+ST_RODATA const char * const target_machine_defs =
     "__x86_64__\0"
     "__amd64__\0"
     ;
 
-ST_DATA const int reg_classes[NB_REGS] = {
+ST_RODATA const int reg_classes[NB_REGS] = {
     /* eax */ RC_INT | RC_RAX,
     /* ecx */ RC_INT | RC_RCX,
     /* edx */ RC_INT | RC_RDX,
@@ -148,17 +148,17 @@ ST_DATA const int reg_classes[NB_REGS] = {
     /* st0 */ RC_ST0
 };
 
-static unsigned long func_sub_sp_offset;
-static int func_ret_sub;
+static ST_TLS unsigned long func_sub_sp_offset;
+static ST_TLS int func_ret_sub;
 
 #if defined(CONFIG_TCC_BCHECK)
-static addr_t func_bound_offset;
-static unsigned long func_bound_ind;
+static ST_TLS addr_t func_bound_offset;
+static ST_TLS unsigned long func_bound_ind;
 ST_DATA int func_bound_add_epilog;
 #endif
 
 #ifdef TCC_TARGET_PE
-static int func_scratch, func_alloca;
+static ST_TLS int func_scratch, func_alloca;
 #endif
 
 /* XXX: make it faster ? */
@@ -2211,6 +2211,15 @@ ST_FUNC void gen_increment_tcov (SValue *sv)
    o(1);
 }
 
+/* subl $1, c(%ebp); jge t -- taken while the loop budget lasts */
+ST_FUNC int gen_loop_budget_dec(int c, int t)
+{
+    o(0x83);
+    gen_modrm(5, VT_LOCAL, NULL, c);
+    g(1);
+    return gjmp_cond(TOK_GE, t);
+}
+
 /* computed goto support */
 void ggoto(void)
 {
@@ -58,7 +58,7 @@ defmodule Niffler do
 
   *Warning:* __NEVER__ write to input binaries. These are pointers into the BEAM VM, changing their values will have unknown but likely horrible consequences.
 
-  Constructing output binaries requires care. The easiest way is to use the built-in macro function `$alloc(size_t)` which allows to allocate memory temporary during the runtime of the nif, that will be automatically freed. Other possibilities are to use the system `malloc()` directly but then `free()` needs to be called at a later point in time, or to use static memory in the module. Stack variables (or from `alloca`) don't work as they are being destroyed before the Niffler program returns and the result values are beeing read. Two examples that are possible here:
+  Constructing output binaries requires care. The easiest way is to use the built-in macro function `$alloc(size_t)` which allows to allocate memory temporary during the runtime of the nif, that will be automatically freed. `$alloc()` returns zeroed memory from a fast per-thread arena, `$alloc_uninit(size_t)` skips the zeroing for buffers that are overwritten anyway. Other possibilities are to use the system `malloc()` directly but then `free()` needs to be called at a later point in time, or to use static memory in the module. Stack variables (or from `alloca`) don't work as they are being destroyed before the Niffler program returns and the result values are beeing read. Two examples that are possible here:
 
   ```
   defmodule BinaryExample
@@ -88,6 +88,95 @@ defmodule Niffler do
   {:ok, [<<3, 2, 1>>]} = BinaryExample.reverse(<<1, 2, 3>>)
   ```
 
+  To avoid the extra copy of the result the output binary can also be allocated directly
+  as an Elixir binary using `$ret_alloc(name, size)`, where `name` is the name of the
+  output variable. `$ret_realloc(name, size)` grows or shrinks such a binary and
+  `$ret_shrink(name, size)` cheaply reduces its final size, for when the exact result size
+  is only known at the end:
+
+  ```
+    defnif :reverse, [input: :binary], [ret: :binary] do
+      \"""
+      unsigned char *out = $ret_alloc(ret, $input.size);
+      for (int i = 0; i < $input.size; i++)
+        out[i] = $input.data[$input.size-(i+1)];
+      \"""
+    end
+  ```
+
+  Parsers often return parts of their input. Instead of copying those into new binaries
+  an output can be declared as `{:slice, input}`, where `input` is the name of a binary
+  input. The fragment then only sets the `offset` and `size` of the slice and the
+  result references the input binary without any copy:
+
+  ```
+    defnif :first_word, [str: :binary], [word: {:slice, :str}] do
+      \"""
+      $word.offset = 0;
+      while ($word.size < $str.size && $str.data[$word.size] != ' ') $word.size++;
+      \"""
+    end
+
+    {:ok, ["hello"]} = first_word("hello world")
+  ```
+
+  Keep in mind that a slice keeps the whole input binary alive for as long as the slice
+  is referenced.
+
+  ## Working with iodata
+
+  Inputs of type `:iovec` accept any iodata without flattening it first. The fragment
+  receives the number of segments in `size` and the segments themselves in `data`.
+  The `$iov_each(name, segment)` macro loops over all segments:
+
+  ```
+    defnif :count_zeros, [body: :iovec], [ret: :int] do
+      \"""
+      $iov_each(body, segment) {
+        for (uint64_t i = 0; i < segment->size; i++)
+          if (segment->data[i] == 0) $ret++;
+      }
+      \"""
+    end
+
+    {:ok, [2]} = count_zeros([<<0, 1>>, "abc", <<0>>])
+  ```
+
+  Binaries and lists of binaries are referenced without any copy. Other iodata, such
+  as nested lists or lists containing bytes, is flattened into a single segment.
+
+  ## Working with arrays
+
+  Numeric vectors can be passed as `{:array, type}` where type is one of `:int64`, `:int32`,
+  `:uint8`, `:float32` or `:double`. Array inputs accept either a list of numbers or a
+  binary with the packed numbers in native byte order, the latter is used without any copy
+  unless it is not aligned to the element size, as can happen with sub binaries.
+  In C arrays are structs with the number of elements and a typed data pointer:
+
+  ```c++
+    typedef struct {
+      uint64_t size;
+      double *data;
+    } DoubleArray;
+  ```
+
+  Array outputs are returned as packed binaries, or as lists when declared as
+  `{:array, type, :list}`. Their memory can be allocated with `$alloc()` or for packed
+  outputs without any copy with `$ret_alloc(name, elements)`:
+
+  ```
+    defnif :scale, [v: {:array, :double}, f: :double], [ret: {:array, :double, :list}] do
+      \"""
+      $ret_alloc(ret, $v.size);
+      for (int i = 0; i < $v.size; i++)
+        $ret.data[i] = $v.data[i] * $f;
+      \"""
+    end
+
+    {:ok, [[2.0, 4.0]]} = scale([1.0, 2.0], 2.0)
+    {:ok, [[2.0, 4.0]]} = scale(<<1.0::float-native, 2.0::float-native>>, 2.0)
+  ```
+
   ## Concurrency
 
   Each generated Niffler function is a small c program in its own call stack. Multiple
@@ -114,6 +203,141 @@ defmodule Niffler do
 
   The same problem affects the static binary example above. When called multiple times concurrently it will overwrite the static variable multiple times return undefined results.
 
+  Compiled programs are cached by their source, parameters and options. Identical fragments,
+  even when defined in different modules, share one program and so also share their static
+  variables. Pass `cache: false` to get a program of its own.
+
+  The functions of a module are compiled together into a single program on the first
+  call of any of them, one program for each distinct set of program options such as
+  `loop_budget:` or `timeout:`. Each function is still compiled as its own translation
+  unit with its own symbols, so static variables and helper functions of different
+  functions don't collide. A function that fails to compile doesn't affect the others,
+  its compile errors are printed and its calls return `{:error, "compilation error"}`.
+
+  ## Object cache
+
+  Compiling all fragments again on every node start can take seconds for larger
+  projects. When an object cache directory is configured, compiled programs are also
+  stored there as relocatable objects and later starts only load and relocate them:
+
+  ```
+    config :niffler, object_cache: "/var/cache/niffler"
+  ```
+
+  Objects are keyed by a hash of the source, parameters, options and system
+  architecture and are stored in a subdirectory per Niffler version. Damaged objects
+  are detected by a checksum and compiled again. When the directory is not writable
+  programs are compiled in memory as usual. Loaded objects are executed in the VM, so
+  the directory must only be writable by the user running the node.
+
+  Modules can also compile their fragments ahead of time with `use Niffler, aot: true`.
+  The objects are then built during `mix compile` and embedded into the module. When
+  the module is loaded they are relocated right away from the embedded copy, so already
+  the first call runs at full speed. Compilation errors are reported by `mix compile`. Objects
+  built for another system architecture are ignored and the source is compiled instead.
+  As the module defines an `@on_load` function, it can't define its own.
+
+  ## Huge pages
+
+  The machine code of all programs is packed into shared 4 MB chunks of memory. When
+  calling many different programs the processor can spend a noticeable time on
+  instruction TLB misses. With huge pages enabled chunks are backed by 2 MB pages:
+
+  ```
+    config :niffler, huge_pages: true
+  ```
+
+  Reserved huge pages (`vm.nr_hugepages`) are used when the system has them. Otherwise
+  chunks are advised to use transparent huge pages, which requires chunks to be mapped
+  writable and executable at once, instead of two separate mappings. When neither is
+  available, normal pages are used. The setting applies to programs compiled after the
+  `:niffler` application has been started.
+
+  ## Long running fragments
+
+  Nifs should return within about a millisecond to not block the BEAM scheduler
+  they are running on. Fragments that can take longer have two options:
+
+  * Run on a dirty scheduler with the `dirty: :cpu` or `dirty: :io` option of `Niffler.defnif/4`
+  * Yield cooperatively back to the scheduler using `$yield_point()` or `$timeslice(percent)`
+
+  `$yield_point()` is cheap enough to be placed in hot loops. It measures the elapsed
+  time and reports it to the scheduler using `enif_consume_timeslice()`. When the
+  timeslice is exhausted the fragment returns and is rescheduled later. `$timeslice(percent)`
+  does the same but with an explicit estimate of the consumed timeslice percentage.
+
+  When rescheduled the fragment is executed again *from the beginning*, with all
+  input and output variables in the state they had when yielding. Memory allocated
+  with `$alloc()` is kept as well. So any loop state must be kept in the `$`-variables
+  or in the four 64-bit `$state[]` slots, which are initialized with zero on the first run:
+
+  ```
+    defnif :count_zeros, [str: :binary], [ret: :int] do
+      \"""
+      while($str.size--) {
+        if (*$str.data++ == 0) $ret++;
+        $yield_point();
+      }
+      \"""
+    end
+
+    defnif :sum, [n: :int], [ret: :int] do
+      \"""
+      while ($state[0] < $n) {
+        $ret += $state[0]++;
+        $yield_point();
+      }
+      \"""
+    end
+  ```
+
+  On dirty schedulers `$yield_point()` and `$timeslice(percent)` never yield.
+
+  Alternatively a function can be executed asynchronously with the `mode: :async` option.
+  The call then returns a reference right away, while the fragment is executed on a pool
+  of Niffler worker threads. Once done the result is sent to the calling process as a
+  `{ref, result}` message:
+
+  ```
+    defnif :count_zeros, [str: :binary], [ret: :int], mode: :async do
+      \"""
+      while($str.size--) {
+        if (*$str.data++ == 0) $ret++;
+      }
+      \"""
+    end
+
+    ref = count_zeros(<<0, 1, 0>>)
+
+    receive do
+      {^ref, {:ok, [2]}} -> :ok
+    end
+  ```
+
+  Invalid arguments are still reported directly as `{:error, message}`. As with dirty
+  schedulers `$yield_point()` and `$timeslice(percent)` never yield in async functions.
+
+  As it's easy to forget a `$yield_point()` the compiler can instead account for the time
+  spent in loops with the `loop_budget: true` option. Each function then counts its loop
+  iterations and every few thousand iterations the elapsed time is reported to the scheduler.
+  When the timeslice is exhausted the next `$yield_point()` will yield. Functions without
+  a `$yield_point()` or `$timeslice(percent)` can't yield and are executed on a dirty CPU
+  scheduler instead, unless they set the `dirty:` or `mode:` option themselves. Together
+  with the `timeout: milliseconds` option runaway loops are aborted:
+
+  ```
+    defnif :spin, [], [ret: :int], timeout: 10 do
+      \"""
+      while (1) $ret++;
+      \"""
+    end
+
+    {:error, "timeout"} = spin()
+  ```
+
+  Memory allocated with `$alloc()` is released on a timeout, but memory allocated
+  with `malloc()` is not.
+
   ## Defining helper functions
 
   When using `Niffler.defnif/4` you sometimes might want to create helper functions
@@ -139,6 +363,9 @@ defmodule Niffler do
   end
   ```
 
+  Helpers are only visible within their function, so different functions of a module
+  can define helpers with the same name.
+
   Interally `DO_RUN` and `END_RUN` are c-macros that will be converted to the correct
   niffler wrapping to execute the code, while anything outside the `DO_RUN` / `END_RUN`
   block will be copied into the c code without modification.
@@ -172,8 +399,32 @@ defmodule Niffler do
       unsigned char* data;
     } Binary;
 
+    typedef struct {
+      uint64_t offset;
+      uint64_t size;
+    } Slice;
+
+    typedef struct {
+      uint64_t size;
+      Binary *data;
+    } IOVec;
+
+    typedef struct { uint64_t size; int64_t *data; } Int64Array;
+    typedef struct { uint64_t size; int32_t *data; } Int32Array;
+    typedef struct { uint64_t size; uint8_t *data; } UInt8Array;
+    typedef struct { uint64_t size; float *data; } Float32Array;
+    typedef struct { uint64_t size; double *data; } DoubleArray;
+
     /* niffler helper */
     void *$alloc(size_t size);
+    void *$alloc_uninit(size_t size);
+    $iov_each(name, segment) { ... }
+    void *$ret_alloc(name, size_t size);
+    void *$ret_realloc(name, size_t size);
+    int $ret_shrink(name, size_t size);
+    $yield_point();
+    $timeslice(int percent);
+    uint64_t $state[4];
 
     /* stdarg.h */
     typedef __builtin_va_list va_list;
@@ -252,11 +503,52 @@ defmodule Niffler do
   """
 
   @on_load :init
+  @version Mix.Project.config()[:version]
   @doc false
-  defmacro __using__(_opts) do
+  defmacro __using__(opts) do
     quote do
       import Niffler
       @niffler_module __MODULE__
+      @niffler_aot unquote(Keyword.get(opts, :aot, false))
+      Module.register_attribute(__MODULE__, :niffler_functions, accumulate: true)
+      @before_compile Niffler
+
+      if @niffler_aot do
+        @on_load :__niffler_load__
+      end
+    end
+  end
+
+  @doc false
+  defmacro __before_compile__(_env) do
+    quote do
+      # All functions with the same program options are compiled into one program
+      @niffler_groups @niffler_functions
+                      |> Enum.reverse()
+                      |> Enum.group_by(&elem(&1, 4), &Tuple.delete_at(&1, 4))
+
+      @doc false
+      def __niffler_program__(group) do
+        Niffler.Registry.fetch({@niffler_module, group}, fn ->
+          Niffler.compile_module!(Map.fetch!(@niffler_groups, group), group)
+        end)
+      end
+
+      if @niffler_aot do
+        @niffler_objects Map.new(@niffler_groups, fn {group, funs} ->
+                           {group, Niffler.compile_object!(funs, group)}
+                         end)
+
+        @doc false
+        def __niffler_load__() do
+          for {group, funs} <- @niffler_groups do
+            opts = group ++ [object: Map.fetch!(@niffler_objects, group)]
+            :persistent_term.put({@niffler_module, group}, Niffler.compile_module!(funs, opts))
+          end
+
+          :ok
+        end
+      end
     end
   end
 
@@ -278,6 +570,13 @@ defmodule Niffler do
   * `uint64` - an unsigned 64-bit integer
   * `double` - a double (floating point number)
   * `binary` - an Elixir binary/string
+  * `iovec` - input only, any iodata passed as a list of binary segments. See
+    "Working with iodata" in the module documentation.
+  * `{:slice, input}` - output only, a part of the binary input named `input`. See
+    "Working with binaries" in the module documentation.
+  * `{:array, type}` - a packed array of `:int64`, `:int32`, `:uint8`, `:float32` or
+    `:double` numbers. See "Working with arrays" in the module documentation.
+  * `{:array, type, :list}` - output only, same as `{:array, type}` but returned as a list
 
   ```
   defmodule Example do
@@ -294,36 +593,146 @@ defmodule Niffler do
 
   {:ok, [2]} = Example.count_zeros(<<0,1,0>>)
   ```
+
+  Next to the function itself a `name_batch/1` function is defined, which executes
+  the function for a list of argument lists in a single nif call. See `Niffler.run_batch/3`.
+
+  ```
+  {:ok, [[2], [0]]} = Example.count_zeros_batch([[<<0,1,0>>], ["abc"]])
+  ```
+
+  Additional options can be passed before the `do` block:
+
+  * `dirty: :cpu | :io` - executes the nif on the dirty cpu or dirty io schedulers
+    instead of blocking a normal scheduler. Use this for fragments that run longer
+    than a millisecond, such as large binary scans or encodings. Functions without
+    this option are executed directly on the calling scheduler.
+  * `mode: :async` - executes the nif on a Niffler worker thread and returns a reference
+    immediately. The result is sent to the calling process as `{ref, {:ok, outputs}}`
+    or `{ref, {:error, message}}`. The default is `mode: :sync`.
+  * `loop_budget: true` - lets the compiler count the iterations of all `for`, `while`
+    and `do` loops and regularly report the consumed time to the scheduler. See
+    "Long running fragments" in the module documentation.
+  * `timeout: milliseconds` - aborts the fragment with `{:error, "timeout"}` when it
+    runs longer than the given time. Implies `loop_budget: true`.
+  * `cache: false` - always compiles a new program instead of sharing an already
+    compiled identical one. See `Niffler.cache_stats/0`.
+  * `run_stats: true | n` - counts the calls of the program and times every 32nd
+    or every `n`th call. See `Niffler.stats/1`.
+
+  ```
+    defnif :count_zeros, [str: :binary], [ret: :int], dirty: :cpu do
+      \"""
+      while($str.size--) {
+        if (*$str.data++ == 0) $ret++;
+      }
+      \"""
+    end
+  ```
   """
-  defmacro defnif(name, inputs, outputs, do: source) do
+  defmacro defnif(name, inputs, outputs, opts \\ [], block) do
+    {source, block_opts} = Keyword.pop!(block, :do)
+    opts = opts ++ block_opts
     keys = Keyword.keys(inputs) |> Enum.map(fn n -> Macro.var(n, __MODULE__) end)
+    batch_name = String.to_atom("#{name}_batch")
+
+    program =
+      quote do
+        :persistent_term.get({@niffler_module, @niffler_group}, nil) ||
+          __niffler_program__(@niffler_group)
+      end
 
     quote do
-      def unquote(name)(unquote_splicing(keys)) do
-        key = {@niffler_module, unquote(name)}
+      @niffler_group Niffler.program_options(unquote(opts))
+      @niffler_idx Enum.count(@niffler_functions, &(elem(&1, 4) == @niffler_group))
+      @niffler_functions {unquote(source), unquote(inputs), unquote(outputs),
+                          Niffler.method_options(unquote(opts)), @niffler_group}
 
-        :persistent_term.get(key, nil)
-        |> case do
-          nil ->
-            prog = Niffler.compile!(unquote(source), unquote(inputs), unquote(outputs))
-            :persistent_term.put(key, prog)
-            prog
+      def unquote(name)(unquote_splicing(keys)) do
+        unquote(program)
+        |> Niffler.run(@niffler_idx, [unquote_splicing(keys)])
+      end
 
-          prog ->
-            prog
-        end
-        |> Niffler.run([unquote_splicing(keys)])
+      def unquote(batch_name)(args_list) do
+        unquote(program)
+        |> Niffler.run_batch(@niffler_idx, args_list)
       end
     end
   end
 
   @doc false
-  def gen!(key, source, inputs, outputs) do
-    :persistent_term.put(key, Niffler.compile!(source, inputs, outputs))
+  def compile_module(funs, opts) do
+    code =
+      Enum.with_index(funs)
+      |> Enum.map(fn {{source, inputs, outputs, _opts}, idx} ->
+        """
+        #undef DO_RUN
+        #define DO_RUN #{method_name("run_#{idx}")} {
+        #{wrap_run(source, inputs, outputs)}
+        """
+      end)
+
+    params =
+      Enum.map(funs, fn {source, inputs, outputs, fun_opts} ->
+        {inputs, outputs, budget_options(fun_opts, source, opts)}
+      end)
+
+    compile_program(code, params, opts)
+  end
+
+  @doc false
+  def compile_module!(funs, opts) do
+    case compile_module(funs, opts) do
+      {:ok, prog} -> prog
+      {:error, message} -> raise CompileError, description: message
+    end
+  end
+
+  @doc false
+  def compile_object!(funs, opts) do
+    dir = private_tmp_dir!()
+
+    try do
+      case compile_module(funs, opts ++ [object_cache: dir]) do
+        {:ok, _prog} ->
+          case Path.wildcard(Path.join(dir, "*/*.o")) do
+            [path] -> {:erlang.system_info(:system_architecture), File.read!(path)}
+            [] -> nil
+          end
+
+        {:error, message} ->
+          raise CompileError, description: message
+      end
+    after
+      File.rm_rf(dir)
+    end
+  end
+
+  # A new directory only the current user can access, so no one else can place
+  # an object in it that would then be embedded into the module
+  defp private_tmp_dir!() do
+    name = "niffler_aot_" <> Base.encode16(:crypto.strong_rand_bytes(16), case: :lower)
+    dir = Path.join(System.tmp_dir!(), name)
+
+    case File.mkdir(dir) do
+      :ok ->
+        File.chmod!(dir, 0o700)
+        dir
+
+      {:error, :eexist} ->
+        private_tmp_dir!()
+
+      {:error, reason} ->
+        raise File.Error, reason: reason, action: "make directory", path: dir
+    end
   end
 
   @doc false
   def init do
+    # The NIF keeps runtime statistics per thread and needs to know the dirty schedulers
+    dirty_schedulers =
+      :erlang.system_info(:dirty_cpu_schedulers) + :erlang.system_info(:dirty_io_schedulers)
+
     :ok =
       case :code.priv_dir(:niffler) do
         {:error, :bad_name} ->
@@ -338,7 +747,7 @@ defmodule Niffler do
       end
       |> Path.join("niffler.nif")
       |> String.to_charlist()
-      |> :erlang.load_nif(0)
+      |> :erlang.load_nif(dirty_schedulers)
   end
 
   @doc """
@@ -356,64 +765,191 @@ defmodule Niffler do
       iex> Niffler.run(prog, [<<0,1,1,0,1,5,0>>])
       {:ok, [3]}
 
+  `opts` accepts the same options as `Niffler.defnif/4`. With `stats: true` the result
+  is `{:ok, prog, stats}`, see `Niffler.compile_stats/1`.
+
+  Compilation runs on a dirty CPU scheduler and does not take a global lock, so several
+  processes can compile programs at the same time. See `Niffler.compile_async/4` to not
+  wait for the result.
   """
-  def compile(code, inputs, outputs)
-      when is_binary(code) and is_list(inputs) and is_list(outputs) do
-    code =
-      if String.contains?(code, "DO_RUN") do
-        """
+  def compile(code, inputs, outputs, opts \\ [])
+      when is_binary(code) and is_list(inputs) and is_list(outputs) and is_list(opts) do
+    result =
+      wrap_run(code, inputs, outputs)
+      |> compile_program(
+        [{inputs, outputs, budget_options(method_options(opts), code, opts)}],
+        program_options(opts)
+      )
+
+    case result do
+      {:ok, prog} -> if opts[:stats], do: {:ok, prog, compile_stats(prog)}, else: result
+      error -> error
+    end
+  end
+
+  defp wrap_run(code, inputs, outputs) do
+    if String.contains?(code, "DO_RUN") do
+      """
+      #{type_defs(inputs, outputs)}
+      #{code}
+      #{type_undefs(inputs, outputs)}
+      """
+    else
+      """
+      DO_RUN
         #{type_defs(inputs, outputs)}
         #{code}
         #{type_undefs(inputs, outputs)}
-        """
-      else
-        """
-        DO_RUN
-          #{type_defs(inputs, outputs)}
-          #{code}
-          #{type_undefs(inputs, outputs)}
-        END_RUN
-        """
-      end
-
-    compile(code, [{inputs, outputs}])
+      END_RUN
+      """
+    end
   end
 
   @doc false
-  def compile!(code, inputs, outputs) do
-    {:ok, prog} = compile(code, inputs, outputs)
+  def compile!(code, inputs, outputs, opts \\ []) do
+    {:ok, prog} = compile(code, inputs, outputs, opts)
     prog
   end
 
+  @doc """
+  Same as `Niffler.compile/4` but returns a reference right away. Once compiled the
+  result is sent to the calling process as a `{ref, {:ok, prog}}` or
+  `{ref, {:error, message}}` message. Exceptions raised while compiling, such as an
+  unknown parameter type, are reported as an `{:error, message}` result as well.
+
+  ## Examples
+
+      iex> ref = Niffler.compile_async("$ret = $a * $b;", [a: :int, b: :int], [ret: :int])
+      iex> receive do
+      ...>   {^ref, {:ok, prog}} -> Niffler.run(prog, [3, 4])
+      ...> end
+      {:ok, [12]}
+
+  """
+  def compile_async(code, inputs, outputs, opts \\ [])
+      when is_binary(code) and is_list(inputs) and is_list(outputs) and is_list(opts) do
+    ref = make_ref()
+    caller = self()
+
+    spawn(fn ->
+      result =
+        try do
+          compile(code, inputs, outputs, opts)
+        catch
+          kind, reason -> {:error, Exception.format_banner(kind, reason, __STACKTRACE__)}
+        end
+
+      send(caller, {ref, result})
+    end)
+
+    ref
+  end
+
+  @doc false
+  def method_options(opts) do
+    Keyword.take(opts, [:dirty, :mode])
+  end
+
+  # A loop budget only yields at the next $yield_point() or $timeslice(), so
+  # functions without one are moved to a dirty CPU scheduler instead of holding
+  # a normal scheduler until they are done.
+  @doc false
+  def budget_options(method_opts, source, program_opts) do
+    budget = program_opts[:loop_budget] || program_opts[:timeout]
+
+    if budget && !Keyword.has_key?(method_opts, :dirty) && method_opts[:mode] != :async &&
+         !Regex.match?(~r/\$(yield_point|timeslice)\s*\(/, source) do
+      method_opts ++ [dirty: :cpu]
+    else
+      method_opts
+    end
+  end
+
+  @doc false
+  def program_options(opts) do
+    Keyword.take(opts, [:loop_budget, :timeout, :cache, :run_stats, :object, :object_cache])
+  end
+
   @doc false
   def compile(code, params) do
+    compile_program(code, params, [])
+  end
+
+  @doc false
+  def compile_program(code, params, opts) do
+    {object, opts} = Keyword.pop(opts, :object)
+    {dir, opts} = Keyword.pop(opts, :object_cache, Application.get_env(:niffler, :object_cache))
+
+    # A list of sources is compiled as separate translation units, one per method
     code =
-      """
-        #{header()}
-        #{code}
-      """ <> <<0>>
+      if is_list(code) do
+        Enum.map(code, &(&1 <> <<0>>))
+      else
+        code <> <<0>>
+      end
 
-    case nif_compile(code, params) do
+    # The header is parsed once per thread and shared by all compiles, see `tcc_set_prelude()`
+    opts = opts ++ [prelude: header() <> <<0>>]
+
+    case nif_compile(code, params, object_file(code, params, opts, dir, object)) do
       {:error, message} ->
         message =
           if message == "compilation error" do
+            units = List.wrap(code)
+
             lines =
-              String.split(code, "\n")
-              |> Enum.with_index(1)
-              |> Enum.map(fn {line, num} -> String.pad_leading("#{num}: ", 4) <> line end)
-              |> Enum.drop(length(String.split(header(), "\n")))
+              Enum.map(units, fn unit ->
+                String.split(unit, "\n")
+                |> Enum.with_index(1)
+                |> Enum.map(fn {line, num} -> String.pad_leading("#{num}: ", 4) <> line end)
+                |> Enum.join("\n")
+              end)
               |> Enum.join("\n")
 
             IO.puts(lines)
-            message <> " in '#{code}'"
+            message <> " in '#{Enum.join(units)}'"
           else
             message
           end
 
         {:error, message}
 
-      other ->
-        other
+      {:ok, prog, compiled} ->
+        if compiled, do: emit_compile_event(prog)
+        {:ok, prog}
+    end
+  end
+
+  # :telemetry is an optional dependency
+  defp emit_compile_event(prog) do
+    if Code.ensure_loaded?(:telemetry) do
+      :telemetry.execute([:niffler, :compile], compile_stats(prog), %{program: prog})
+    end
+  end
+
+  defp object_file(_code, _params, opts, nil, nil), do: opts
+
+  defp object_file(code, params, opts, dir, object) do
+    arch = :erlang.system_info(:system_architecture)
+
+    # Ahead of time compiled objects are only used on the architecture they were built
+    # for and are loaded straight from the module, never from a file someone else wrote
+    case object do
+      {^arch, data} ->
+        opts ++ [object: data]
+
+      _ when dir == nil ->
+        opts
+
+      _ ->
+        dir = Path.join(dir, @version)
+        File.mkdir_p(dir)
+
+        hash =
+          :crypto.hash(:sha256, [code, :erlang.term_to_binary({params, opts}), arch])
+          |> Base.encode16(case: :lower)
+
+        opts ++ [object_file: Path.join(dir, hash <> ".o")]
     end
   end
 
@@ -423,7 +959,13 @@ defmodule Niffler do
     prog
   end
 
-  defp nif_compile(_code, _params) do
+  @doc false
+  def compile_program!(code, params, opts) do
+    {:ok, prog} = compile_program(code, params, opts)
+    prog
+  end
+
+  defp nif_compile(_code, _params, _opts) do
     :erlang.nif_error(:nif_library_not_loaded)
   end
 
@@ -447,12 +989,248 @@ defmodule Niffler do
     :erlang.nif_error(:nif_library_not_loaded)
   end
 
+  @doc """
+  Executes the given Niffler program once for each argument list in `args_list`
+  within a single nif call. For very small fragments this avoids most of the call
+  overhead. Returns `{:ok, list_of_outputs}` or the first `{:error, message}`.
+
+  Long batches are split automatically to not exceed the scheduler timeslice.
+  Methods with the `dirty:` option run the whole batch on a dirty scheduler.
+  Batches always run synchronously, also for methods with the `mode: :async` option.
+
+  ## Examples
+
+      iex> {:ok, prog} = Niffler.compile("$ret = $a << 2;", [a: :int], [ret: :int])
+      iex> Niffler.run_batch(prog, [[1], [2], [3]])
+      {:ok, [[4], [8], [12]]}
+
+  """
+  def run_batch(prog, method \\ 0, args_list) do
+    nif_run_batch(prog, method, args_list)
+  end
+
+  defp nif_run_batch(_state, _method, _args_list) do
+    :erlang.nif_error(:nif_library_not_loaded)
+  end
+
+  @doc """
+  Returns statistics of the memory used by `$alloc()` over all threads:
+
+  * `high_water` - the largest number of bytes a single thread arena had in use
+  * `spills` - the number of allocations that did not fit into the arena and used `malloc()`
+  * `spill_bytes` - the total size of those allocations
+
+  ## Examples
+
+      iex> %{high_water: _, spills: _, spill_bytes: _} = Niffler.arena_stats()
+
+  """
+  def arena_stats() do
+    {high_water, spills, spill_bytes} = nif_arena_stats()
+    %{high_water: high_water, spills: spills, spill_bytes: spill_bytes}
+  end
+
+  defp nif_arena_stats() do
+    :erlang.nif_error(:nif_library_not_loaded)
+  end
+
+  @doc """
+  Returns statistics of the program cache. Compiling the same source with the same
+  parameters and options returns the already compiled program:
+
+  * `hits` - the number of compiles that returned a cached program
+  * `misses` - the number of compiles that had to run the compiler
+  * `evictions` - the number of programs dropped from the cache when it was full
+  * `size` - the number of programs currently in the cache
+
+  ## Examples
+
+      iex> %{hits: _, misses: _, evictions: _, size: _} = Niffler.cache_stats()
+
+  """
+  def cache_stats() do
+    {hits, misses, evictions, size} = nif_cache_stats()
+    %{hits: hits, misses: misses, evictions: evictions, size: size}
+  end
+
+  defp nif_cache_stats() do
+    :erlang.nif_error(:nif_library_not_loaded)
+  end
+
+  @doc """
+  Returns the memory used by a compiled program in bytes. After relocation the
+  compiler state is released and only the code and the entry points are kept:
+
+  * `code` - the size of the relocated code and data
+  * `before` - the memory the program used right after compiling
+  * `after` - the memory the program uses now
+
+  ## Examples
+
+      iex> {:ok, prog} = Niffler.compile("$ret = $a + 1;", [a: :int], [ret: :int])
+      iex> %{code: _, before: before, after: size} = Niffler.memory_info(prog)
+      iex> size < before
+      true
+
+  """
+  def memory_info(prog) do
+    {code, before, size} = nif_memory_info(prog)
+    %{code: code, before: before, after: size}
+  end
+
+  defp nif_memory_info(_prog) do
+    :erlang.nif_error(:nif_library_not_loaded)
+  end
+
+  @doc """
+  Returns how long the compile of a program took and what it produced. Times are
+  in nanoseconds:
+
+  * `compile` - preprocessing, parsing and code generation, which TinyCC does in a
+    single pass. For programs loaded from the object cache the time to load the object
+  * `link` - adding the runtime, resolving symbols and laying out the sections
+  * `relocate` - copying the code into executable memory and applying the relocations
+  * `total` - the whole compile call, including the scanning of parameters and options
+
+  And the counts:
+
+  * `tokens` - the tokens of the source read by the parser, not counting the Niffler
+    header, zero for programs loaded from objects
+  * `symbols` - the entries of the symbol table
+  * `relocations` - the relocation entries
+  * `code_bytes` - the size of the relocated code and data
+  * `pages` - the number of memory pages the code spans
+
+  On Windows `link` also includes the relocation, and `code_bytes` and `pages` are zero.
+
+  When `:telemetry` is available, each compile that did not return a cached program
+  also emits a `[:niffler, :compile]` event with these values as measurements and
+  `%{program: prog}` as metadata.
+
+  ## Examples
+
+      iex> {:ok, prog} = Niffler.compile("$ret = $a + 1;", [a: :int], [ret: :int])
+      iex> %{total: total, compile: compile, link: link} = Niffler.compile_stats(prog)
+      iex> total >= compile + link
+      true
+
+  """
+  def compile_stats(prog) do
+    {compile, link, relocate, total, tokens, symbols, relocations, code_bytes, pages} =
+      nif_compile_stats(prog)
+
+    %{
+      compile: compile,
+      link: link,
+      relocate: relocate,
+      total: total,
+      tokens: tokens,
+      symbols: symbols,
+      relocations: relocations,
+      code_bytes: code_bytes,
+      pages: pages
+    }
+  end
+
+  defp nif_compile_stats(_prog) do
+    :erlang.nif_error(:nif_library_not_loaded)
+  end
+
+  @doc """
+  Returns the runtime statistics of a program compiled with the `run_stats` option,
+  one map for each method, or `nil` without that option:
+
+  * `calls` - the number of calls that ran the fragment
+  * `errors` - the number of those calls that returned an error
+  * `bytes_in` - the bytes passed in binary, slice, array and iovec inputs
+  * `bytes_out` - the bytes returned in binary, slice, array and iovec outputs
+  * `samples` - the number of timed calls, with `run_stats: n` every `n`th call
+    rounded up to a power of two
+  * `total_ns` - the total time of the timed calls in nanoseconds
+  * `max_ns` - the longest timed call
+  * `histogram` - the timed calls as `{nanoseconds, count}` buckets, where each
+    bucket counts the calls between its own and the next bucket's nanoseconds
+
+  The time of a call includes the encoding of its outputs. Calls that yield are
+  timed until they return, including the time they were waiting to be rescheduled.
+
+  The counters are kept per scheduler and async pool thread, so calls do not contend
+  on them. Programs returned by the cache share their statistics.
+
+  ## Examples
+
+      iex> {:ok, prog} = Niffler.compile("$ret = $a + 1;", [a: :int], [ret: :int], run_stats: 1)
+      iex> {:ok, [2]} = Niffler.run(prog, [1])
+      iex> [%{calls: 1, errors: 0, samples: 1, histogram: [{_ns, 1}]}] = Niffler.stats(prog)
+
+  """
+  def stats(prog) do
+    case nif_run_stats(prog) do
+      nil -> nil
+      methods -> Enum.map(methods, &method_stats/1)
+    end
+  end
+
+  defp method_stats({calls, errors, bytes_in, bytes_out, samples, total, max, histogram}) do
+    %{
+      calls: calls,
+      errors: errors,
+      bytes_in: bytes_in,
+      bytes_out: bytes_out,
+      samples: samples,
+      total_ns: total,
+      max_ns: max,
+      histogram: histogram
+    }
+  end
+
+  defp nif_run_stats(_prog) do
+    :erlang.nif_error(:nif_library_not_loaded)
+  end
+
+  @doc """
+  Emits the runtime statistics of a program as `:telemetry` events, one
+  `[:niffler, :run]` event for each method. The counters of `Niffler.stats/1` are
+  the measurements, the metadata contains the `program`, the `method` index and the
+  latency `histogram` next to the given `metadata`. Intended to be called
+  periodically, e.g. as a measurement of `:telemetry_poller`.
+  """
+  def emit_stats(prog, metadata \\ %{}) do
+    if Code.ensure_loaded?(:telemetry) do
+      (stats(prog) || [])
+      |> Enum.with_index()
+      |> Enum.each(fn {stats, method} ->
+        {histogram, measurements} = Map.pop(stats, :histogram)
+
+        meta = Map.merge(metadata, %{program: prog, method: method, histogram: histogram})
+        :telemetry.execute([:niffler, :run], measurements, meta)
+      end)
+    end
+
+    :ok
+  end
+
+  @doc false
+  def set_huge_pages(enabled) when is_boolean(enabled) do
+    nif_set_huge_pages(enabled)
+  end
+
+  defp nif_set_huge_pages(_enabled) do
+    :erlang.nif_error(:nif_library_not_loaded)
+  end
+
   defp value_name(:int), do: "integer64"
   defp value_name(:int64), do: "integer64"
   defp value_name(:uint64), do: "uinteger64"
   defp value_name(:double), do: "doubleval"
   defp value_name(:binary), do: "binary"
-  defp value_name(other), do: raise("Unknown type #{other} in defnif")
+  defp value_name(:iovec), do: "iovec"
+  defp value_name({:slice, _input}), do: "slice"
+  defp value_name({:array, type, :list}), do: value_name({:array, type})
+
+  defp value_name({:array, type}) when type in [:int64, :int32, :uint8, :float32, :double],
+    do: "#{type}_array"
+  defp value_name(other), do: raise("Unknown type #{inspect(other)} in defnif")
 
   defp header() do
     """
@@ -469,6 +1247,8 @@ defmodule Niffler do
       {
         uint64_t method;
         void *head;
+        uint64_t countdown;
+        uint64_t state[4];
       } Env;
 
       typedef struct {
@@ -476,8 +1256,31 @@ defmodule Niffler do
         unsigned char* data;
       } Binary;
 
+      typedef struct {
+        uint64_t offset;
+        uint64_t size;
+      } Slice;
+
+      typedef struct { uint64_t size; int64_t *data; } Int64Array;
+      typedef struct { uint64_t size; int32_t *data; } Int32Array;
+      typedef struct { uint64_t size; uint8_t *data; } UInt8Array;
+      typedef struct { uint64_t size; float *data; } Float32Array;
+      typedef struct { uint64_t size; double *data; } DoubleArray;
+
+      typedef struct {
+        uint64_t size;
+        Binary *data;
+      } IOVec;
+
       typedef union {
         Binary binary;
+        Slice slice;
+        IOVec iovec;
+        Int64Array int64_array;
+        Int32Array int32_array;
+        UInt8Array uint8_array;
+        Float32Array float32_array;
+        DoubleArray double_array;
         int64_t integer64;
         uint64_t uinteger64;
         double doubleval;
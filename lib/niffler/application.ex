@@ -0,0 +1,11 @@
+defmodule Niffler.Application do
+  @moduledoc false
+  use Application
+
+  @impl true
+  def start(_type, _args) do
+    Niffler.set_huge_pages(Application.get_env(:niffler, :huge_pages, false))
+    children = [Niffler.Registry]
+    Supervisor.start_link(children, strategy: :one_for_one, name: Niffler.Supervisor)
+  end
+end
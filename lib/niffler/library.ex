@@ -81,17 +81,22 @@ defmodule Niffler.Library do
     {ok, [result]} = Gmp.mul(4, 5)
   ```
 
+  Options that apply to the whole library, such as `loop_budget: true` or
+  `timeout: milliseconds`, are passed to `use Niffler.Library`. See `Niffler.defnif/4`
+  for details.
+
   """
 
   @doc false
-  defmacro __using__(_opts) do
+  defmacro __using__(opts) do
     quote do
       @module __MODULE__
+      @niffler_options Niffler.program_options(unquote(opts))
       @on_load :pre_compile
       @behaviour Niffler.Library
 
       def pre_compile() do
-        program = Niffler.Library.compile(@module, header(), on_load())
+        program = Niffler.Library.compile(@module, header(), on_load(), @niffler_options)
         :persistent_term.put({@module, :niffler_program}, program)
         :ok
       end
@@ -184,14 +189,21 @@ defmodule Niffler.Library do
 
   @spec defnif(atom(), keyword, keyword, [{:do, binary()}]) ::
           {:__block__, [], [{any, any, any}, ...]}
+  @spec defnif(atom(), keyword, keyword, keyword, [{:do, binary()}]) ::
+          {:__block__, [], [{any, any, any}, ...]}
   @doc """
     Defines a new nif function in the current module.
 
     Same as `Niffler.defnif/4` but with access to the current module context.
+    Accepts the same options, e.g. `dirty: :cpu`, on a per function basis and
+    defines the same `name_batch/1` function.
   """
-  defmacro defnif(name, inputs, outputs, do: source) do
+  defmacro defnif(name, inputs, outputs, opts \\ [], block) do
+    {source, block_opts} = Keyword.pop!(block, :do)
+    opts = Niffler.method_options(opts ++ block_opts)
     keys = Keyword.keys(inputs) |> Enum.map(fn n -> Macro.var(n, __MODULE__) end)
     key = {name, length(inputs)}
+    batch_name = String.to_atom("#{name}_batch")
 
     quote do
       nifs = Module.get_attribute(@module, :niffler_nifs, [])
@@ -201,13 +213,19 @@ defmodule Niffler.Library do
       Module.put_attribute(
         @module,
         :niffler_nifs,
-        nifs ++ [{unquote(key), unquote(inputs), unquote(outputs), unquote(source)}]
+        nifs ++
+          [{unquote(key), unquote(inputs), unquote(outputs), unquote(opts), unquote(source)}]
       )
 
       def unquote(name)(unquote_splicing(keys)) do
         :persistent_term.get({@module, :niffler_program})
         |> Niffler.run(@idx, [unquote_splicing(keys)])
       end
+
+      def unquote(batch_name)(args_list) do
+        :persistent_term.get({@module, :niffler_program})
+        |> Niffler.run_batch(@idx, args_list)
+      end
     end
   end
 
@@ -243,7 +261,7 @@ defmodule Niffler.Library do
   end
 
   @doc false
-  def compile(module, header, on_load) do
+  def compile(module, header, on_load, opts \\ []) do
     funs =
       if function_exported?(module, :__info__, 1) do
         module.__info__(:attributes)[:niffler_nifs] || []
@@ -253,7 +271,7 @@ defmodule Niffler.Library do
 
     cases =
       Enum.with_index(funs)
-      |> Enum.map(fn {{_, inputs, outputs, source}, idx} ->
+      |> Enum.map(fn {{_, inputs, outputs, _opts, source}, idx} ->
         """
         case #{idx}: {
             #{Niffler.type_defs(inputs, outputs)}
@@ -265,9 +283,12 @@ defmodule Niffler.Library do
       end)
       |> Enum.join("\n  ")
 
-    params = Enum.map(funs, fn {_key, inputs, outputs, _source} -> {inputs, outputs} end)
+    params =
+      Enum.map(funs, fn {_key, inputs, outputs, fun_opts, source} ->
+        {inputs, outputs, Niffler.budget_options(fun_opts, source, opts)}
+      end)
 
-    Niffler.compile!(
+    Niffler.compile_program!(
       """
         #{header}
 
@@ -285,7 +306,8 @@ defmodule Niffler.Library do
           }
         END_RUN
       """,
-      params
+      params,
+      opts
     )
   end
 end
@@ -0,0 +1,93 @@
+defmodule Niffler.Registry do
+  @moduledoc """
+  Stores the programs compiled on the first call of a `Niffler.defnif/4` function.
+
+  When many processes call a new function at the same time only one of them compiles
+  the program, the others wait for the result. Programs are kept in `:persistent_term`
+  and are only written once per key. Updating an existing persistent term triggers a
+  global garbage collection, while adding a new key does not.
+
+  The registry is started by the `:niffler` application. When it is not running,
+  e.g. during `mix compile`, programs are compiled directly by the caller.
+  """
+  use GenServer
+
+  @doc false
+  def start_link(opts \\ []) do
+    GenServer.start_link(__MODULE__, :ok, Keyword.put_new(opts, :name, __MODULE__))
+  end
+
+  @doc """
+  Returns the program stored under `key`. When there is none yet `fun` is called
+  to compile it. Concurrent calls for the same key share a single call of `fun`.
+  Exceptions raised by `fun` are raised in all waiting callers.
+  """
+  def fetch(key, fun) do
+    case :persistent_term.get(key, nil) do
+      nil -> compile(key, fun)
+      prog -> prog
+    end
+  end
+
+  defp compile(key, fun) do
+    case Process.whereis(__MODULE__) do
+      nil ->
+        prog = fun.()
+        :persistent_term.put(key, prog)
+        prog
+
+      pid ->
+        case GenServer.call(pid, {:fetch, key, fun}, :infinity) do
+          {:ok, prog} -> prog
+          {:error, kind, reason, stacktrace} -> :erlang.raise(kind, reason, stacktrace)
+        end
+    end
+  end
+
+  @impl true
+  def init(:ok) do
+    {:ok, %{}}
+  end
+
+  @impl true
+  def handle_call({:fetch, key, fun}, from, waiting) do
+    case {:persistent_term.get(key, nil), waiting} do
+      {nil, %{^key => {task, callers}}} ->
+        {:noreply, Map.put(waiting, key, {task, [from | callers]})}
+
+      {nil, _} ->
+        task =
+          Task.async(fn ->
+            try do
+              {:ok, fun.()}
+            catch
+              kind, reason -> {:error, kind, reason, __STACKTRACE__}
+            end
+          end)
+
+        {:noreply, Map.put(waiting, key, {task, [from]})}
+
+      {prog, _} ->
+        {:reply, {:ok, prog}, waiting}
+    end
+  end
+
+  @impl true
+  def handle_info({ref, result}, waiting) when is_reference(ref) do
+    Process.demonitor(ref, [:flush])
+
+    case Enum.find(waiting, fn {_key, {task, _callers}} -> task.ref == ref end) do
+      nil ->
+        {:noreply, waiting}
+
+      {key, {_task, callers}} ->
+        with {:ok, prog} <- result, do: :persistent_term.put(key, prog)
+        Enum.each(callers, &GenServer.reply(&1, result))
+        {:noreply, Map.delete(waiting, key)}
+    end
+  end
+
+  def handle_info(_msg, waiting) do
+    {:noreply, waiting}
+  end
+end
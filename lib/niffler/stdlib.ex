@@ -92,7 +92,29 @@ defmodule Niffler.Stdlib do
     /* Niffler extensions */
 
     void *niffler_alloc(Env *, size_t);
+    void *niffler_alloc_uninit(Env *, size_t);
     #define $alloc(size) niffler_alloc(niffler_env, (size))
+    #define $alloc_uninit(size) niffler_alloc_uninit(niffler_env, (size))
+    #define $iov_each(name, segment) \\
+      for (Binary *segment = $##name.data; segment < $##name.data + $##name.size; segment++)
+
+    void *niffler_ret_alloc(Env *, void *, size_t);
+    void *niffler_ret_realloc(Env *, void *, size_t);
+    int niffler_ret_shrink(Env *, void *, size_t);
+    #define $ret_alloc(name, size) niffler_ret_alloc(niffler_env, &$##name, (size))
+    #define $ret_realloc(name, size) niffler_ret_realloc(niffler_env, &$##name, (size))
+    #define $ret_shrink(name, size) niffler_ret_shrink(niffler_env, &$##name, (size))
+
+    int niffler_yield_point(Env *);
+    int niffler_timeslice(Env *, int);
+    #define NIFFLER_YIELD ((const char *)1)
+    #define $state (niffler_env->state)
+    #define $yield_point() do { \\
+      if (--niffler_env->countdown == 0 && niffler_yield_point(niffler_env)) return NIFFLER_YIELD; \\
+    } while (0)
+    #define $timeslice(percent) do { \\
+      if (niffler_timeslice(niffler_env, (percent))) return NIFFLER_YIELD; \\
+    } while (0)
 
 
     #endif /* _TCCLIB_H */
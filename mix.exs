@@ -28,13 +28,15 @@ defmodule Niffler.MixProject do
   # Run "mix help compile.app" to learn about applications.
   def application do
     [
-      extra_applications: [:logger]
+      mod: {Niffler.Application, []},
+      extra_applications: [:logger, :crypto]
     ]
   end
 
   defp deps do
     [
       {:mix_rebar3, "~> 0.2"},
+      {:telemetry, "~> 0.4 or ~> 1.0", optional: true},
       {:dialyxir, "~> 1.0", only: [:dev], runtime: false},
       {:benchee, "~> 1.0", only: :dev},
       {:ex_doc, "~> 0.22", only: :dev, runtime: false}
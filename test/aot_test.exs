@@ -0,0 +1,68 @@
+defmodule AotTest do
+  use ExUnit.Case
+
+  defmodule Aot do
+    use Niffler, aot: true
+
+    defnif :mul, [a: :int, b: :int], ret: :int do
+      """
+      $ret = $a * $b;
+      """
+    end
+
+    defnif :count_zeros, [str: :binary], [ret: :int], loop_budget: true do
+      """
+      while($str.size--) {
+        if (*$str.data++ == 0) $ret++;
+      }
+      """
+    end
+  end
+
+  test "programs are loaded with the module" do
+    assert :persistent_term.get({Aot, []}, nil) != nil
+    assert :persistent_term.get({Aot, [loop_budget: true]}, nil) != nil
+    assert {:ok, [12]} = Aot.mul(3, 4)
+    assert {:ok, [2]} = Aot.count_zeros(<<0, 1, 0>>)
+    assert {:ok, [[2], [6]]} = Aot.mul_batch([[1, 2], [2, 3]])
+  end
+
+  test "functions with the same helper share one cached object" do
+    dir = Path.join(System.tmp_dir!(), "niffler_aot_test_#{System.unique_integer([:positive])}")
+
+    helper = """
+    int64_t twice(int64_t x) { return x * 2; }
+    """
+
+    funs = [
+      {helper <> "DO_RUN\n$ret = twice($a);\nEND_RUN\n", [a: :int], [ret: :int], []},
+      {helper <> "DO_RUN\n$ret = twice($a) + 1;\nEND_RUN\n", [a: :int], [ret: :int], []}
+    ]
+
+    try do
+      assert {:ok, prog} = Niffler.compile_module(funs, object_cache: dir, cache: false)
+      assert [_object] = Path.wildcard(Path.join(dir, "*/*.o"))
+      assert {:ok, [4]} = Niffler.run(prog, 0, [2])
+      assert {:ok, [5]} = Niffler.run(prog, 1, [2])
+
+      # The second compile loads the object
+      assert {:ok, prog} = Niffler.compile_module(funs, object_cache: dir, cache: false)
+      assert {:ok, [4]} = Niffler.run(prog, 0, [2])
+      assert {:ok, [5]} = Niffler.run(prog, 1, [2])
+    after
+      File.rm_rf!(dir)
+    end
+  end
+
+  test "embedded objects are loaded from memory" do
+    funs = [{"$ret = $a + 1;", [a: :int], [ret: :int], []}]
+    {arch, data} = Niffler.compile_object!(funs, [])
+    assert {:ok, prog} = Niffler.compile_module(funs, object: {arch, data}, cache: false)
+    assert {:ok, [2]} = Niffler.run(prog, [1])
+
+    # Damaged objects are ignored and the source is compiled instead
+    broken = "broken" <> data
+    assert {:ok, prog} = Niffler.compile_module(funs, object: {arch, broken}, cache: false)
+    assert {:ok, [2]} = Niffler.run(prog, [1])
+  end
+end
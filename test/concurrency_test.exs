@@ -26,6 +26,31 @@ defmodule ConcurrencyTest do
     end)
   end
 
+  # loop_budget: true gives this function a program of its own
+  defnif :first_call, [a: :int], [ret: :int], loop_budget: true do
+    """
+    $ret = $a + 1;
+    """
+  end
+
+  test "test single compile on first call" do
+    %{misses: misses} = Niffler.cache_stats()
+
+    results =
+      spawn_workers(50, fn ->
+        {:ok, [ret]} = first_call(1)
+        ret
+      end)
+
+    assert Enum.all?(results, &(&1 == 2))
+    assert %{misses: new_misses} = Niffler.cache_stats()
+    assert new_misses == misses + 1
+
+    assert_raise MatchError, fn ->
+      Niffler.Registry.fetch({__MODULE__, :broken}, fn -> Niffler.compile!("$ret = ;", [], ret: :int) end)
+    end
+  end
+
   defp testdata(size) do
     data = :crypto.strong_rand_bytes(size)
     answer = count_zeros(data)
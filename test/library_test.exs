@@ -86,10 +86,23 @@ defmodule LibraryTest do
       $ret = mpz_get_si(mc);
       """
     end
+
+    defnif :add_dirty, [a: :int, b: :int], [ret: :int], dirty: :cpu do
+      """
+      mpz_set_si(ma, $a);
+      mpz_set_si(mb, $b);
+      mpz_add(mc, ma, mb);
+      $ret = mpz_get_si(mc);
+      """
+    end
   end
 
   test "gmp tests" do
     assert {:ok, [12]} = Gmp.mul(3, 4)
     assert {:ok, [2]} = Gmp.add(1, 1)
+    assert {:ok, [[12], [20]]} = Gmp.mul_batch([[3, 4], [4, 5]])
+    assert {:ok, [[2], [5]]} = Gmp.add_batch([[1, 1], [2, 3]])
+    assert {:ok, [2]} = Gmp.add_dirty(1, 1)
+    assert {:ok, [[2], [5]]} = Gmp.add_dirty_batch([[1, 1], [2, 3]])
   end
 end
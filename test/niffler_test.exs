@@ -19,6 +19,239 @@ defmodule NifflerTest do
     assert {:error, "parameter should be binary"} = count_zeros([])
   end
 
+  test "test batch" do
+    assert {:ok, [[2], [1], [0]]} = count_zeros_batch([[<<0, 11, 0>>], [<<0>>], [<<13>>]])
+    assert {:ok, []} = count_zeros_batch([])
+    assert {:error, "parameter should be binary"} = count_zeros_batch([[<<0>>], [1]])
+
+    batch = for n <- 1..10_000, do: [:binary.copy(<<0>>, rem(n, 100))]
+    assert {:ok, results} = count_zeros_batch(batch)
+    assert Enum.map(batch, fn [bin] -> [byte_size(bin)] end) == results
+  end
+
+  test "test program cache" do
+    code = "$ret = $a * 7;"
+    %{hits: hits} = Niffler.cache_stats()
+    {:ok, prog} = Niffler.compile(code, [a: :int], ret: :int)
+    assert {:ok, ^prog} = Niffler.compile(code, [a: :int], ret: :int)
+    assert %{hits: new_hits} = Niffler.cache_stats()
+    assert new_hits > hits
+
+    assert {:ok, other} = Niffler.compile(code, [a: :int], [ret: :int], cache: false)
+    assert other != prog
+    assert {:ok, [14]} = Niffler.run(other, [2])
+  end
+
+  test "test object cache" do
+    dir = Path.join(System.tmp_dir!(), "niffler_object_cache_test")
+    File.rm_rf!(dir)
+    Application.put_env(:niffler, :object_cache, dir)
+
+    try do
+      code = "$ret = $a * 11;"
+      assert {:ok, prog} = Niffler.compile(code, [a: :int], [ret: :int], cache: false)
+      assert {:ok, [22]} = Niffler.run(prog, [2])
+      assert [object] = Path.wildcard(Path.join(dir, "*/*.o"))
+
+      assert {:ok, prog} = Niffler.compile(code, [a: :int], [ret: :int], cache: false)
+      assert {:ok, [33]} = Niffler.run(prog, [3])
+
+      File.write!(object, "broken")
+      assert {:ok, prog} = Niffler.compile(code, [a: :int], [ret: :int], cache: false)
+      assert {:ok, [44]} = Niffler.run(prog, [4])
+      assert File.read!(object) != "broken"
+    after
+      Application.delete_env(:niffler, :object_cache)
+      File.rm_rf!(dir)
+    end
+  end
+
+  test "test compile async" do
+    ref = Niffler.compile_async("$ret = $a + $b;", [a: :int, b: :int], ret: :int)
+    assert_receive {^ref, {:ok, prog}}, 5_000
+    assert {:ok, [5]} = Niffler.run(prog, [2, 3])
+
+    ref = Niffler.compile_async("$ret = $a +;", [a: :int], ret: :int)
+    assert_receive {^ref, {:error, "compilation error" <> _}}, 5_000
+
+    ref = Niffler.compile_async("$ret = $a;", [a: :unknown], ret: :int)
+    assert_receive {^ref, {:error, message}}, 5_000
+    assert message =~ "Unknown type :unknown"
+  end
+
+  test "test compile stats" do
+    code = "for (int i = 0; i < $a; i++) $ret += i;"
+
+    assert {:ok, prog, stats} =
+             Niffler.compile(code, [a: :int], [ret: :int], cache: false, stats: true)
+
+    assert {:ok, [45]} = Niffler.run(prog, [10])
+    assert stats == Niffler.compile_stats(prog)
+    assert stats.total >= stats.compile + stats.link + stats.relocate
+    assert stats.tokens > 0 and stats.symbols > 0
+
+    # The header is not counted, whether or not it was parsed for this compile
+    assert {:ok, _prog, again} =
+             Niffler.compile(code, [a: :int], [ret: :int], cache: false, stats: true)
+
+    assert again.tokens == stats.tokens
+    assert stats.tokens < 100
+  end
+
+  test "test run stats" do
+    code = "if ($str.size == 0) return \"empty\"; $ret = $str;"
+
+    assert {:ok, prog} =
+             Niffler.compile(code, [str: :binary], [ret: :binary], cache: false, run_stats: 1)
+
+    assert [%{calls: 0, samples: 0, histogram: []}] = Niffler.stats(prog)
+    assert {:ok, ["abc"]} = Niffler.run(prog, ["abc"])
+    assert {:error, "empty"} = Niffler.run(prog, [""])
+    assert {:ok, [["a"], ["bc"]]} = Niffler.run_batch(prog, [["a"], ["bc"]])
+
+    assert [%{calls: 4, errors: 1, bytes_in: 6, bytes_out: 6, samples: 4} = stats] =
+             Niffler.stats(prog)
+
+    assert stats.total_ns >= stats.max_ns
+    assert Enum.sum(Enum.map(stats.histogram, &elem(&1, 1))) == 4
+
+    assert {:ok, prog} = Niffler.compile("$ret = 1;", [], [ret: :int], cache: false)
+    assert Niffler.stats(prog) == nil
+  end
+
+  test "test header state is restored between compiles" do
+    # The units of one program are compiled one after the other on the same thread,
+    # so each one starts from the header state the previous one left behind. The
+    # strlen definitions are local to their units and don't replace the one of libc.
+    funs =
+      [
+        "#undef EOF\n#define EOF 7\n$ret = EOF;",
+        "$ret = EOF;",
+        "struct __FILE { int64_t fd; };\nDO_RUN\n struct __FILE f = {3}; $ret = f.fd;\nEND_RUN",
+        "struct __FILE { int32_t a, b; };\nDO_RUN\n $ret = sizeof(struct __FILE);\nEND_RUN",
+        "size_t strlen(const char *s) { return 42; }\nDO_RUN\n $ret = strlen(\"abc\");\nEND_RUN",
+        "size_t strlen(const char *s) { return 43; }\nDO_RUN\n $ret = strlen(\"abc\");\nEND_RUN",
+        "$ret = strlen(\"abc\");"
+      ]
+      |> Enum.map(&{&1, [], [ret: :int], []})
+
+    assert {:ok, prog} = Niffler.compile_module(funs, cache: false)
+
+    results = Enum.map(0..(length(funs) - 1), &Niffler.run(prog, &1, []))
+    assert results == Enum.map([7, -1, 3, 8, 42, 43, 3], &{:ok, [&1]})
+  end
+
+  defnif :dirty_count_zeros, [str: :binary], [ret: :int], dirty: :cpu do
+    """
+    while($str.size--) {
+      if (*$str.data++ == 0) $ret++;
+    }
+    """
+  end
+
+  defnif :dirty_io_add, [a: :int, b: :int], [ret: :int], dirty: :io do
+    """
+    $ret = $a + $b;
+    """
+  end
+
+  test "test dirty schedulers" do
+    assert {:ok, [2]} = dirty_count_zeros(<<0, 11, 0>>)
+    assert {:ok, [0]} = dirty_count_zeros(<<>>)
+    assert {:error, "parameter should be binary"} = dirty_count_zeros([])
+    assert {:ok, [5]} = dirty_io_add(2, 3)
+  end
+
+  defnif :async_count_zeros, [str: :binary], [ret: :int], mode: :async do
+    """
+    while($str.size--) {
+      if (*$str.data++ == 0) $ret++;
+    }
+    """
+  end
+
+  test "test async mode" do
+    refs = for n <- 1..10, do: {n, async_count_zeros(:binary.copy(<<0, 1>>, n * 1000))}
+
+    for {n, ref} <- refs do
+      assert_receive {^ref, {:ok, [count]}}, 1000
+      assert count == n * 1000
+    end
+
+    assert {:error, "parameter should be binary"} = async_count_zeros(1)
+  end
+
+  test "test invalid dirty option" do
+    assert {:error, "Method option dirty must be :cpu, :io or false"} =
+             Niffler.compile("$ret = 1;", [], [ret: :int], dirty: :gpu)
+  end
+
+  defnif :yield_count_zeros, [str: :binary], ret: :int do
+    """
+    while($str.size--) {
+      if (*$str.data++ == 0) $ret++;
+      $yield_point();
+    }
+    """
+  end
+
+  defnif :timeslice_sum, [n: :int], ret: :int do
+    """
+    while ($state[0] < $n) {
+      $ret += $state[0]++;
+      $timeslice(10);
+    }
+    """
+  end
+
+  test "test yielding" do
+    data = :binary.copy(<<0, 1, 2, 3>>, 5_000_000)
+    assert {:ok, [5_000_000]} = yield_count_zeros(data)
+    assert {:ok, [4950]} = timeslice_sum(100)
+  end
+
+  defnif :budget_count_zeros, [str: :binary], [ret: :int], loop_budget: true do
+    """
+    while($str.size--) {
+      if (*$str.data++ == 0) $ret++;
+    }
+    """
+  end
+
+  defnif :spin, [], [ret: :int], timeout: 10 do
+    """
+    for (;;) $ret++;
+    """
+  end
+
+  test "test loop budget" do
+    data = :binary.copy(<<0, 1, 2, 3>>, 5_000_000)
+    assert {:ok, [5_000_000]} = budget_count_zeros(data)
+    assert {:error, "timeout"} = spin()
+  end
+
+  defnif :budget_spin, [n: :int], [ret: :int], loop_budget: true do
+    """
+    while (1) {
+      if (++$ret == $n) break;
+    }
+    """
+  end
+
+  test "test loop budget without yield point doesn't hold a normal scheduler" do
+    online = :erlang.system_flag(:schedulers_online, 1)
+    parent = self()
+
+    try do
+      spawn(fn -> send(parent, {:spin, budget_spin(1_000_000_000)}) end)
+      Process.sleep(1)
+      refute_received {:spin, _}
+      assert_receive {:spin, {:ok, [1_000_000_000]}}, 60_000
+    after
+      :erlang.system_flag(:schedulers_online, online)
+    end
+  end
+
   defnif :hello_wrong, [], ret: :binary do
     """
     "Hello from C";
@@ -49,8 +282,52 @@ defmodule NifflerTest do
     """
   end
 
+  # Defines the same non-static helper as fib above
+  defnif :double_fib, [a: :int], ret: :int do
+    """
+    int64_t fib(int64_t f) {
+      if (f < 2) return 1;
+      return fib(f-1) + fib(f-2);
+    }
+
+    DO_RUN
+      $ret = 2 * fib($a);
+    END_RUN
+    """
+  end
+
   test "test fib" do
     assert {:ok, [8]} = fib(5)
+    assert {:ok, [16]} = double_fib(5)
+    assert {:ok, [2]} = count_zeros(<<0, 1, 0>>)
+  end
+
+  defmodule Broken do
+    use Niffler
+
+    defnif :inc, [a: :int], ret: :int do
+      """
+      $ret = $a + 1;
+      """
+    end
+
+    defnif :broken, [a: :int], ret: :int do
+      """
+      $ret = $a +;
+      """
+    end
+
+    defnif :dec, [a: :int], ret: :int do
+      """
+      $ret = $a - 1;
+      """
+    end
+  end
+
+  test "test one broken function doesn't break the others" do
+    assert {:ok, [2]} = Broken.inc(1)
+    assert {:error, "compilation error"} = Broken.broken(1)
+    assert {:ok, [0]} = Broken.dec(1)
   end
 
   defnif :counter, [], ret: :int do
@@ -67,6 +344,23 @@ defmodule NifflerTest do
     assert {:ok, [3]} = counter()
   end
 
+  defnif :other_counter, [], ret: :int do
+    """
+    static uint64_t counter = 100;
+    $ret = counter++;
+    """
+  end
+
+  test "test module program" do
+    # other_counter has its own static counter next to the one of counter
+    assert {:ok, [100]} = other_counter()
+    assert {:ok, [101]} = other_counter()
+
+    # functions with the same program options share one program
+    assert {:ok, [2]} = count_zeros(<<0, 1, 0>>)
+    assert :persistent_term.get({NifflerTest, []}) != nil
+  end
+
   defnif :make_binary, [], ret: :binary do
     """
     static char lol[16];
@@ -16,6 +16,136 @@ defmodule StdlibTest do
     assert {:ok, [<<1, 2, 3>>]} = reverse(<<3, 2, 1>>)
   end
 
+  defnif :ret_alloc_reverse, [input: :binary], [ret: :binary, tail: :binary] do
+    """
+    unsigned char *out = $ret_alloc(ret, $input.size * 2);
+    for (int i = 0; i < $input.size; i++)
+      out[i] = $input.data[$input.size-(i+1)];
+    $ret_shrink(ret, $input.size);
+
+    out = $ret_alloc(tail, 1);
+    out[0] = 'a';
+    out = $ret_realloc(tail, 2);
+    out[1] = 'b';
+    """
+  end
+
+  test "test ret_alloc" do
+    assert {:ok, ["ab", <<1, 2, 3>>]} = ret_alloc_reverse(<<3, 2, 1>>)
+  end
+
+  defnif :split, [str: :binary], [first: {:slice, :str}, rest: {:slice, :str}] do
+    """
+    while ($first.size < $str.size && $str.data[$first.size] != ' ') $first.size++;
+    $rest.offset = $first.size < $str.size ? $first.size + 1 : $str.size;
+    $rest.size = $str.size - $rest.offset;
+    """
+  end
+
+  defnif :bad_slice, [str: :binary], [ret: {:slice, :str}] do
+    """
+    $ret.offset = $str.size;
+    $ret.size = 1;
+    """
+  end
+
+  test "test slice" do
+    assert {:ok, ["world", "hello"]} = split("hello world")
+    assert {:ok, ["", "hello"]} = split("hello")
+    assert {:error, "slice is out of the input binary bounds"} = bad_slice("hello")
+
+    assert {:error, "Parameter element {name, {:slice, input}} - input is not a binary input"} =
+             Niffler.compile("", [a: :int], ret: {:slice, :a})
+  end
+
+  defnif :scratch_sum, [n: :int], [ret: :int, zero: :int] do
+    """
+    for (int i = 0; i < $n; i++) {
+      int64_t *scratch = $alloc_uninit(sizeof(int64_t) * 4);
+      scratch[0] = i;
+      $ret += scratch[0];
+    }
+    int64_t *big = $alloc(1024 * 1024);
+    $zero = big[1024 * 1024 / sizeof(int64_t) - 1];
+    """
+  end
+
+  test "test alloc arena" do
+    assert {:ok, [0, 4950]} = scratch_sum(100)
+    assert %{high_water: high_water, spills: spills} = Niffler.arena_stats()
+    assert high_water >= 100 * 32
+    assert spills >= 1
+  end
+
+  defnif :misaligned_allocs, [n: :int], [ret: :int] do
+    """
+    for (int i = 1; i <= $n; i++) {
+      if (((uintptr_t)$alloc(i) & 15) != 0) $ret++;
+    }
+    """
+  end
+
+  test "test alloc alignment" do
+    assert {:ok, [0]} = misaligned_allocs(1)
+    assert {:ok, [0]} = misaligned_allocs(100)
+  end
+
+  defnif :scale, [v: {:array, :double}, f: :double], [ret: {:array, :double, :list}] do
+    """
+    $ret_alloc(ret, $v.size);
+    for (int i = 0; i < $v.size; i++)
+      $ret.data[i] = $v.data[i] * $f;
+    """
+  end
+
+  defnif :histogram, [bytes: {:array, :uint8}], [ret: {:array, :int32}] do
+    """
+    $ret_alloc(ret, 4);
+    for (int i = 0; i < 4; i++) $ret.data[i] = 0;
+    for (int i = 0; i < $bytes.size; i++) $ret.data[$bytes.data[i] & 3]++;
+    """
+  end
+
+  test "test arrays" do
+    assert {:ok, [[2.0, 4.0, 7.0]]} = scale([1.0, 2, 3.5], 2.0)
+    assert {:ok, [[3.0, 4.0]]} = scale(<<1.5::float-native, 2.0::float-native>>, 2.0)
+    assert {:ok, [[]]} = scale([], 2.0)
+    assert {:error, "parameter should be a list or binary of the array type"} = scale(<<1>>, 2.0)
+
+    # A sub binary at an odd offset is copied to an aligned buffer
+    doubles = for i <- 1..100, into: <<>>, do: <<i * 1.0::float-native>>
+    unaligned = binary_part(<<0>> <> doubles, 1, byte_size(doubles))
+    assert {:ok, [ret]} = scale(unaligned, 2.0)
+    assert ret == Enum.map(1..100, &(&1 * 2.0))
+
+    assert {:ok, [<<2::native-32, 1::native-32, 0::native-32, 1::native-32>>]} =
+             histogram([0, 1, 3, 4])
+
+    assert {:ok, [<<2::native-32, 1::native-32, 0::native-32, 1::native-32>>]} =
+             histogram(<<0, 1, 3, 4>>)
+
+    assert {:error, "parameter should be a list or binary of the array type"} = histogram([256])
+  end
+
+  defnif :iov_count_zeros, [body: :iovec], [ret: :int, segments: :int] do
+    """
+    $segments = $body.size;
+    $iov_each(body, segment) {
+      for (uint64_t i = 0; i < segment->size; i++)
+        if (segment->data[i] == 0) $ret++;
+    }
+    """
+  end
+
+  test "test iovec" do
+    big = :binary.copy(<<0, 1>>, 1000)
+    assert {:ok, [3, 1001]} = iov_count_zeros([big, "abc", <<0>>])
+    assert {:ok, [1, 1000]} = iov_count_zeros(big)
+    assert {:ok, [1, 2]} = iov_count_zeros(["a", [0, "b", [<<0>>]]])
+    assert {:ok, [0, 0]} = iov_count_zeros([])
+    assert {:error, "parameter should be iodata"} = iov_count_zeros(:atom)
+  end
+
   defnif :sprintf, [], ret: :binary do
     """
     static char lol[16];